@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "stats.c"
+
 enum ASTNodeType
 {
     PROGRAM_NODE,
@@ -10,6 +12,7 @@ enum ASTNodeType
     SET_NODE,
     IF_NODE,
     WHILE_NODE,
+    FOR_NODE,
     HOST_NODE,
     FUNCTION_CALL_NODE,
     ADD_NODE,
@@ -18,6 +21,15 @@ enum ASTNodeType
     EQUALS_NODE,
     OR_NODE,
     PIPE_NODE,
+    TEE_NODE,
+    ERROR_PIPE_NODE,
+    REDIRECT_NODE,
+    SUBSTITUTION_NODE,
+    BACKGROUND_NODE,
+    WAIT_NODE,
+    PARALLEL_NODE,
+    SLEEP_NODE,
+    TIMEOUT_NODE,
     NAME_NODE,
     NUMBER_NODE,
     STRING_NODE,
@@ -33,6 +45,10 @@ struct ASTNode
         char *string;
         int number;
     };
+    int symbol; // index into the symbol table for variable names, filled in before the program runs
+    int id; // unique within a program, for tools that want to keep per-node data on the side
+    int source_start; // byte offsets into the script
+    int source_end;
     struct ASTNode *parent;
     struct ASTNode *first_child;
     struct ASTNode *next_sibling;
@@ -40,15 +56,86 @@ struct ASTNode
 
 typedef struct ASTNode ASTNode;
 
+// what a REDIRECT_NODE does, kept in its number
+enum RedirectKind
+{
+    REDIRECT_STDOUT, // ->
+    REDIRECT_STDOUT_APPEND, // ->>
+    REDIRECT_STDERR, // !->
+    REDIRECT_STDERR_APPEND, // !->>
+    REDIRECT_STDIN // <-
+};
+
+// a PARALLEL_NODE keeps its number of workers in number, along with this flag if the output has to stay in order
+const int PARALLEL_ORDERED = 1 << 16;
+enum { PARALLEL_MAX_WORKERS = 16 };
+
+// SLEEP_NODEs and TIMEOUT_NODEs keep how many milliseconds there are in a unit of their duration in number
+const int DURATION_SECONDS = 1000;
+const int DURATION_MILLISECONDS = 1;
+
+int n_ast_node_ids = 0;
+
 ASTNode *alloc_ast_node(enum ASTNodeType type)
 {
     ASTNode *node = malloc(sizeof(ASTNode));
+    allocation_stats.n_ast_nodes += 1;
+    allocation_stats.ast_node_bytes += sizeof(ASTNode);
     node->type = type;
+    node->symbol = -1;
+    node->id = n_ast_node_ids;
+    n_ast_node_ids += 1;
+    node->source_start = 0;
+    node->source_end = 0;
+    node->parent = 0;
     node->first_child = 0;
     node->next_sibling = 0;
     return node;
 }
 
+const char *ast_node_type_name(enum ASTNodeType type)
+{
+    switch (type)
+    {
+        case PROGRAM_NODE: return "PROGRAM";
+        case CODEBLOCK_NODE: return "CODEBLOCK";
+        case PRINT_NODE: return "PRINT";
+        case EXIT_NODE: return "EXIT";
+        case SET_NODE: return "SET";
+        case IF_NODE: return "IF";
+        case WHILE_NODE: return "WHILE";
+        case FOR_NODE: return "FOR";
+        case HOST_NODE: return "HOST";
+        case FUNCTION_CALL_NODE: return "FUNCCALL";
+        case ADD_NODE: return "ADD";
+        case MULTIPLY_NODE: return "MULTIPLY";
+        case LESSTHAN_NODE: return "LESS THAN";
+        case EQUALS_NODE: return "EQUALS";
+        case OR_NODE: return "OR";
+        case PIPE_NODE: return "PIPE";
+        case TEE_NODE: return "TEE";
+        case ERROR_PIPE_NODE: return "ERROR PIPE";
+        case REDIRECT_NODE: return "REDIRECT";
+        case SUBSTITUTION_NODE: return "SUBSTITUTION";
+        case BACKGROUND_NODE: return "BACKGROUND";
+        case WAIT_NODE: return "WAIT";
+        case PARALLEL_NODE: return "PARALLEL";
+        case SLEEP_NODE: return "SLEEP";
+        case TIMEOUT_NODE: return "TIMEOUT";
+        case NAME_NODE: return "NAME";
+        case NUMBER_NODE: return "NUMBER";
+        case STRING_NODE: return "STRING";
+        case RAW_TEXT_NODE: return "RAW_TEXT";
+    }
+
+    return "UNKNOWN";
+}
+
+int ast_node_has_string(enum ASTNodeType type)
+{
+    return type == FUNCTION_CALL_NODE || type == NAME_NODE || type == STRING_NODE || type == RAW_TEXT_NODE;
+}
+
 void ast_attach_child(ASTNode *parent, ASTNode *child)
 {
     parent->first_child = child;
@@ -61,6 +148,9 @@ void ast_attach_sibling(ASTNode *older, ASTNode *younger)
     younger->parent = older->parent;
 }
 
+// --spans, for checking where the parser thinks each node starts and ends
+int print_ast_spans = 0;
+
 void print_ast_indented(ASTNode *tree, int indent)
 {
     int n_indented = 0;
@@ -70,85 +160,39 @@ void print_ast_indented(ASTNode *tree, int indent)
         n_indented += 1;
     }
 
+    printf("%s", ast_node_type_name(tree->type));
+
     switch (tree->type)
     {
-        case PROGRAM_NODE:
-            printf("PROGRAM");
-        break;
-        
-        case CODEBLOCK_NODE:
-            printf("CODEBLOCK");
-        break;
-
-        case PRINT_NODE:
-            printf("PRINT");
-        break;
-
-        case EXIT_NODE:
-            printf("EXIT");
-        break;
-
-        case SET_NODE:
-            printf("SET");
-        break;
-
-        case IF_NODE:
-            printf("IF");
-        break;
-
-        case WHILE_NODE:
-            printf("WHILE");
-        break;
-
-        case HOST_NODE:
-            printf("HOST");
-        break;
-
         case FUNCTION_CALL_NODE:
-            printf("FUNCCALL [%s]", tree->name);
-        break;
-
-        case ADD_NODE:
-            printf("ADD");
-        break;
-
-        case MULTIPLY_NODE:
-            printf("MULTIPLY");
-        break;
-
-        case LESSTHAN_NODE:
-            printf("LESS THAN");
-        break;
-
-        case EQUALS_NODE:
-            printf("EQUALS");
-        break;
-
-        case OR_NODE:
-            printf("OR");
+        case NAME_NODE:
+            printf(" [%s]", tree->name);
         break;
 
-        case PIPE_NODE:
-            printf("PIPE");
+        case NUMBER_NODE:
+        case REDIRECT_NODE:
+            printf(" [%d]", tree->number);
         break;
 
-        case NAME_NODE:
-            printf("NAME [%s]", tree->name);
+        case SLEEP_NODE:
+        case TIMEOUT_NODE:
+            printf(" [%s]", tree->number == DURATION_MILLISECONDS ? "ms" : "s");
         break;
 
-        case NUMBER_NODE:
-            printf("NUMBER [%d]", tree->number);
+        case STRING_NODE:
+        case RAW_TEXT_NODE:
+            printf(" [%s]", tree->string);
         break;
 
-        case STRING_NODE:
-            printf("STRING [%s]", tree->string);
+        case PARALLEL_NODE:
+            printf(" [%d%s]", tree->number & ~PARALLEL_ORDERED, tree->number & PARALLEL_ORDERED ? " ordered" : "");
         break;
 
-        case RAW_TEXT_NODE:
-            printf("RAW_TEXT [%s]", tree->string);
+        default:
         break;
     }
 
+    if (print_ast_spans) printf(" @%d-%d", tree->source_start, tree->source_end);
     printf("\n");
 
     ASTNode *child = tree->first_child;
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Runs each paired workload in tests/workloads/ under cha and /bin/sh and prints one CSV row per run:
+#
+#     workload,interpreter,wall_s,cpu_s,max_rss_kb,syscalls,exit_code
+#
+# Usage: bench/compare.sh [-l input_lines] [-c loop_count] [-f fanout] [-r runs] [workload...]
+#
+# Expects ./cha to be built. Syscall counts need strace and are reported as NA without it. CPU time and
+# peak RSS include child processes, since most of the work in a pipeline happens in them.
+
+cd "$(dirname "$0")/.."
+
+input_lines=200000
+loop_count=100000
+fanout=200
+runs=3
+while getopts "l:c:f:r:" option
+do
+    case $option in
+        l) input_lines=$OPTARG ;;
+        c) loop_count=$OPTARG ;;
+        f) fanout=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+workloads="$*"
+if [ -z "$workloads" ]
+then
+    workloads=$(ls tests/workloads/*.cha | xargs -n 1 basename | sed 's/\.cha$//')
+fi
+
+if [ ! -x ./cha ]
+then
+    echo "ERROR: build ./cha first" >&2
+    exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -o "$work/measure" bench/measure.c || exit 1
+
+# generated input: a mix of short lines, some of which the filter workload keeps
+awk -v n="$input_lines" 'BEGIN {
+    split("apple pie,oranges,apple sauce,a somewhat longer line of text that nobody is looking for,pears", words, ",")
+    for (i = 0; i < n; i++) print words[i % 5 + 1]
+}' > "$work/input.txt"
+
+# workloads that don't read stdin get an empty one
+needs_input="filter passthrough"
+
+echo "workload,interpreter,wall_s,cpu_s,max_rss_kb,syscalls,exit_code"
+for workload in $workloads
+do
+    input=/dev/null
+    case " $needs_input " in *" $workload "*) input="$work/input.txt" ;; esac
+
+    for interpreter in cha sh
+    do
+        extension=$interpreter
+        script="$work/$workload.$extension"
+        sed -e "s/@COUNT@/$loop_count/g" -e "s/@FANOUT@/$fanout/g" "tests/workloads/$workload.$extension" > "$script"
+
+        if [ $interpreter = cha ]
+        then
+            command="./cha $script"
+        else
+            command="/bin/sh $script"
+        fi
+
+        for run in $(seq "$runs")
+        do
+            read -r wall cpu rss code < <("$work/measure" "$input" $command)
+
+            syscalls=NA
+            if command -v strace > /dev/null
+            then
+                strace -f -c -o "$work/strace.txt" $command < "$input" > /dev/null 2>&1
+                syscalls=$(awk '$NF == "total" { print $4 }' "$work/strace.txt")
+            fi
+
+            echo "$workload,$interpreter,$wall,$cpu,$rss,$syscalls,$code"
+        done
+    done
+done
@@ -0,0 +1,122 @@
+/*
+Lexer throughput benchmark.
+
+    cc -O2 -o bench_lexer bench/lexer.c
+    ./bench_lexer [megabytes | script.cha]
+
+Without a script it generates a synthetic one of the given size (default 32 MB) that mixes indentation,
+comments, strings, names, numbers and host commands in roughly the proportions our generated scripts have.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../parser.c"
+
+double now_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+char *generate_script(int n_bytes, int *length)
+{
+    const char *lines[] =
+    {
+        "set counter = counter + 1\n",
+        "        # a comment that runs on for a while, like the ones the generator emits\n",
+        "if counter < 100000 print \"counter is below the limit \\\"still\\\"\"\n",
+        "grep --line-buffered -e pattern /var/log/some/file.log\n",
+        "{\n",
+        "    print \"a plain string with no escapes in it at all\" + counter\n",
+        "    set total = total * 2 + 12345\n",
+        "}\n",
+        "while counter < 10 or done == 0\n",
+        "    ... print counter\n",
+    };
+    const int n_lines = sizeof(lines) / sizeof(lines[0]);
+
+    char *script = malloc(n_bytes + 256);
+    int i = 0;
+    int line = 0;
+    while (i < n_bytes)
+    {
+        int line_length = strlen(lines[line]);
+        memcpy(&script[i], lines[line], line_length);
+        i += line_length;
+        line = (line + 1) % n_lines;
+    }
+
+    *length = i;
+    return script;
+}
+
+char *read_script(char *filename, int *length)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *script = malloc(size);
+    *length = fread(script, 1, size, file);
+    fclose(file);
+    return script;
+}
+
+int main(int argc, char **argv)
+{
+    int length;
+    char *script;
+    int megabytes = 32;
+    if (argc > 1 && atoi(argv[1]) > 0)
+    {
+        megabytes = atoi(argv[1]);
+        script = generate_script(megabytes * 1024 * 1024, &length);
+    }
+    else if (argc > 1)
+    {
+        script = read_script(argv[1], &length);
+        if (!script)
+        {
+            printf("File not found: %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else
+    {
+        script = generate_script(megabytes * 1024 * 1024, &length);
+    }
+
+    const int n_runs = 5;
+    double best = 1e9;
+    long n_tokens = 0;
+    for (int run = 0; run < n_runs; run++)
+    {
+        Lexer lexer[1];
+        lexer_init(lexer, script, length);
+
+        double start = now_seconds();
+        n_tokens = 0;
+        while (lexer_next_language_token(lexer) && lexer->token.type != TOKEN_TYPE_EOF)
+        {
+            n_tokens += 1;
+        }
+        double elapsed = now_seconds() - start;
+        if (elapsed < best) best = elapsed;
+    }
+
+    double start = now_seconds();
+    parse(script, length);
+    double parse_elapsed = now_seconds() - start;
+
+    double mb = length / (1024.0 * 1024.0);
+    printf("lexer: %.1f MB, %ld tokens, best of %d: %.4f s (%.1f MB/s, %.1f Mtokens/s)\n",
+        mb, n_tokens, n_runs, best, mb / best, n_tokens / best * 1e-6);
+    printf("parse: %.4f s (%.1f MB/s)\n", parse_elapsed, mb / parse_elapsed);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+Runs a command and reports its wall time, CPU time and peak RSS on one line, for bench/compare.sh.
+
+    cc -O2 -o bench_measure bench/measure.c
+    ./bench_measure <stdin file> <command> [arguments...]
+
+The command's stdout is discarded. Output is "wall_seconds cpu_seconds max_rss_kb exit_code".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+double now_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s <stdin file> <command> [arguments...]\n", argv[0]);
+        return 1;
+    }
+
+    double start = now_seconds();
+    int pid = fork();
+    if (pid == 0)
+    {
+        int input = open(argv[1], O_RDONLY);
+        int output = open("/dev/null", O_WRONLY);
+        if (input == -1 || output == -1)
+        {
+            printf("ERROR: Could not open \"%s\" or /dev/null\n", argv[1]);
+            exit(127);
+        }
+        dup2(input, STDIN_FILENO);
+        dup2(output, STDOUT_FILENO);
+        execvp(argv[2], &argv[2]);
+        printf("ERROR: Could not start process \"%s\".\n", argv[2]);
+        exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    double wall = now_seconds() - start;
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+
+    printf("%.4f %.4f %ld %d\n", wall, cpu, usage.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+    return 0;
+}
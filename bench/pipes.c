@@ -0,0 +1,369 @@
+/*
+Pipe and scheduler micro-benchmarks.
+
+    cc -O2 -o bench_pipes bench/pipes.c
+    ./bench_pipes [--csv] > bench_output.txt
+
+Every measurement is reported as one record of (benchmark, parameter, value, unit), as a JSON array by
+default or as CSV, so that runs before and after a change can be diffed mechanically.
+*/
+
+#define CHA_NO_MAIN
+#include "../interpreter.c"
+
+#include <time.h>
+#include <sys/wait.h>
+
+FILE *results;
+int output_csv = 0;
+int *n_results; // shared with the process each benchmark runs in, see run_isolated
+
+double now_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+void report(const char *benchmark, const char *parameter, double value, const char *unit)
+{
+    if (output_csv)
+    {
+        if (*n_results == 0) fprintf(results, "benchmark,parameter,value,unit\n");
+        fprintf(results, "%s,%s,%.3f,%s\n", benchmark, parameter, value, unit);
+    }
+    else
+    {
+        fprintf(results, "%s\n  {\"benchmark\": \"%s\", \"parameter\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}",
+            *n_results == 0 ? "[" : ",", benchmark, parameter, value, unit);
+    }
+    fflush(results);
+    *n_results += 1;
+}
+
+void finish_report()
+{
+    if (!output_csv) fprintf(results, "%s]\n", *n_results == 0 ? "[" : "\n");
+}
+
+/*
+Each benchmark runs in a process of its own, forked from one that has never run anything, so none of them
+sees what an earlier one left behind in the interpreter's globals - thread and pipe pools, symbols, fds
+hostio is waiting on, timers, host_pipe_size - and any one of them gives the same result run alone.
+*/
+void run_isolated(void (*benchmark)(int), int parameter)
+{
+    fflush(stdout);
+    fflush(results);
+    int pid = fork();
+    if (pid == 0)
+    {
+        benchmark(parameter);
+        fflush(results);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fprintf(stderr, "benchmark failed (status %d)\n", status);
+}
+
+void fill_line(char *line, int line_length)
+{
+    for (int i = 0; i < line_length - 1; i++) line[i] = 'a' + i % 26;
+    line[line_length - 1] = '\n';
+}
+
+void bench_pipe_throughput(int line_length)
+{
+    char line[PIPE_BUFFER_SIZE];
+    char parameter[64];
+    fill_line(line, line_length);
+    sprintf(parameter, "line_length=%d", line_length);
+
+    const long n_bytes_target = 64L * 1024 * 1024;
+
+    // pipe_write / pipe_read: fill the pipe, then drain it in one go
+    {
+        PipeBuffer *pipe = acquire_internal_pipe();
+        long n_bytes = 0;
+        double start = now_seconds();
+        while (n_bytes < n_bytes_target)
+        {
+            while (pipe_write(pipe, line, line_length)) {}
+            n_bytes += pipe_read(pipe, 0);
+        }
+        double elapsed = now_seconds() - start;
+        report("pipe_write+pipe_read", parameter, n_bytes / elapsed / 1e6, "MB/s");
+        release_internal_pipe(pipe);
+    }
+
+    // pipe_write / pipe_peek_line: fill the pipe, then drain it a line at a time
+    {
+        PipeBuffer *pipe = acquire_internal_pipe();
+        char *line_view;
+        char *copy = 0;
+        int copy_capacity = 0;
+        int n_partial = 0;
+        long n_bytes = 0;
+        long n_lines = 0;
+        double start = now_seconds();
+        while (n_bytes < n_bytes_target)
+        {
+            while (pipe_write(pipe, line, line_length)) {}
+            int n_line;
+            while ((n_line = pipe_peek_line(pipe, 0, &line_view, &copy, &copy_capacity, &n_partial)))
+            {
+                pipe_consume(pipe, 0, n_line);
+                n_lines += 1;
+                n_bytes += line_length;
+            }
+        }
+        double elapsed = now_seconds() - start;
+        report("pipe_write+pipe_peek_line", parameter, n_bytes / elapsed / 1e6, "MB/s");
+        report("pipe_write+pipe_peek_line", parameter, n_lines / elapsed, "lines/s");
+        release_internal_pipe(pipe);
+        free(copy);
+    }
+}
+
+void bench_context_switches(int n_lines)
+{
+    char script[512];
+    sprintf(script,
+        "set n = 0\n"
+        "{\n"
+        "    while n < %d\n"
+        "    {\n"
+        "        print \"a line of text\"\n"
+        "        set n = n + 1\n"
+        "    }\n"
+        "} | {\n"
+        "    set line = readline()\n"
+        "    while line\n"
+        "    {\n"
+        "        set line = readline()\n"
+        "    }\n"
+        "}\n", n_lines);
+
+    ASTNode *program = parse(script, strlen(script));
+    resolve_symbols(program);
+
+    double start = now_seconds();
+    run_program(program);
+    double elapsed = now_seconds() - start;
+
+    report("resume_execution", "producer|consumer", scheduler_n_resumes / elapsed, "resumes/s");
+    report("resume_execution", "producer|consumer", n_lines / elapsed, "lines/s");
+}
+
+void bench_readline(int line_length)
+{
+    char line[PIPE_BUFFER_SIZE];
+    char parameter[64];
+    fill_line(line, line_length);
+    sprintf(parameter, "line_length=%d", line_length);
+
+    InterpreterThread thread;
+    memset(&thread, 0, sizeof(thread));
+
+    // from stdin, through a temporary file
+    {
+        const int n_lines = 200000;
+        FILE *file = tmpfile();
+        for (int i = 0; i < n_lines; i++) fwrite(line, 1, line_length, file);
+        fflush(file);
+        rewind(file);
+
+        int saved_stdin = dup(STDIN_FILENO);
+        dup2(fileno(file), STDIN_FILENO);
+        lseek(STDIN_FILENO, 0, SEEK_SET);
+
+        double start = now_seconds();
+        for (int i = 0; i < n_lines; i++) readline(&thread);
+        double elapsed = now_seconds() - start;
+
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+        fclose(file);
+
+        report("readline(stdin)", parameter, n_lines / elapsed, "lines/s");
+        report("readline(stdin)", parameter, (double) n_lines * line_length / elapsed / 1e6, "MB/s");
+    }
+
+    // from an internal pipe
+    {
+        const long n_lines_target = 1000000;
+        PipeBuffer *pipe = acquire_internal_pipe();
+        thread.read_pipe = pipe;
+        long n_lines = 0;
+        double start = now_seconds();
+        while (n_lines < n_lines_target)
+        {
+            while (pipe_write(pipe, line, line_length)) {}
+            while (readline(&thread)) n_lines += 1;
+        }
+        double elapsed = now_seconds() - start;
+        thread.read_pipe = 0;
+        release_internal_pipe(pipe);
+
+        report("readline(pipe)", parameter, n_lines / elapsed, "lines/s");
+        report("readline(pipe)", parameter, (double) n_lines * line_length / elapsed / 1e6, "MB/s");
+    }
+}
+
+void bench_print(int line_length)
+{
+    char parameter[64];
+    sprintf(parameter, "line_length=%d", line_length);
+
+    Value value;
+    value.type = VALUE_TYPE_STRING;
+    value.string_value = malloc(line_length);
+    fill_line(value.string_value, line_length);
+    value.string_value[line_length - 1] = 0;
+
+    InterpreterThread thread;
+    memset(&thread, 0, sizeof(thread));
+
+    // to stdout, pointed at /dev/null
+    {
+        const int n_lines = 2000000;
+        fflush(stdout);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+
+        double start = now_seconds();
+        for (int i = 0; i < n_lines; i++) print(&thread, &value);
+        fflush(stdout);
+        double elapsed = now_seconds() - start;
+
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        close(null);
+
+        report("print(stdout)", parameter, n_lines / elapsed, "lines/s");
+        report("print(stdout)", parameter, (double) n_lines * line_length / elapsed / 1e6, "MB/s");
+    }
+
+    // into an internal pipe, drained whenever it fills up
+    {
+        const long n_lines_target = 2000000;
+        PipeBuffer *pipe = acquire_internal_pipe();
+        thread.write_pipe = pipe;
+        long n_lines = 0;
+        double start = now_seconds();
+        while (n_lines < n_lines_target)
+        {
+            while (print(&thread, &value)) n_lines += 1;
+            pipe_read(pipe, 0);
+        }
+        double elapsed = now_seconds() - start;
+        thread.write_pipe = 0;
+        release_internal_pipe(pipe);
+
+        report("print(pipe)", parameter, n_lines / elapsed, "lines/s");
+        report("print(pipe)", parameter, (double) n_lines * line_length / elapsed / 1e6, "MB/s");
+    }
+
+    free(value.string_value);
+}
+
+void bench_host_spawn(int n_spawns)
+{
+    char script[256];
+    sprintf(script,
+        "set n = 0\n"
+        "while n < %d\n"
+        "{\n"
+        "    true\n"
+        "    set n = n + 1\n"
+        "}\n", n_spawns);
+
+    int saved_stdin = dup(STDIN_FILENO);
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, STDIN_FILENO);
+
+    ASTNode *program = parse(script, strlen(script));
+    resolve_symbols(program);
+
+    double start = now_seconds();
+    run_program(program);
+    double elapsed = now_seconds() - start;
+
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
+    close(null);
+
+    report("host_spawn", "true", n_spawns / elapsed, "spawns/s");
+}
+
+// cat bigfile | host | host, with the host pipes (and our pipes between them) at various sizes - 0 leaves
+// the kernel's pipes alone and ours at PIPE_BUFFER_SIZE
+void bench_host_chain(int pipe_size)
+{
+    const long n_bytes = 256L * 1024 * 1024;
+    char parameter[64];
+    sprintf(parameter, "pipe_size=%d", pipe_size);
+
+    char path[] = "/tmp/cha_bench_XXXXXX";
+    int file = mkstemp(path);
+    char line[100];
+    fill_line(line, sizeof(line));
+    for (long i = 0; i < n_bytes; i += sizeof(line)) write(file, line, sizeof(line));
+    close(file);
+
+    char script[256];
+    sprintf(script, "cat %s | tr a b | wc -c\n", path);
+
+    fflush(stdout);
+    int saved_stdin = dup(STDIN_FILENO);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+
+    host_pipe_size = pipe_size;
+    ASTNode *program = parse(script, strlen(script));
+    resolve_symbols(program);
+
+    double start = now_seconds();
+    run_program(program);
+    fflush(stdout);
+    double elapsed = now_seconds() - start;
+
+    dup2(saved_stdin, STDIN_FILENO);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdin);
+    close(saved_stdout);
+    close(null);
+    unlink(path);
+
+    report("host_chain", parameter, n_bytes / elapsed / 1e6, "MB/s");
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (streq(argv[i], "--csv")) output_csv = 1;
+    }
+
+    // print benchmarks take over stdout, so results go to a duplicate of it
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    n_results = mmap(0, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    *n_results = 0;
+
+    int line_lengths[] = { 8, 64, 256, 1000 };
+    for (int i = 0; i < 4; i++) run_isolated(bench_pipe_throughput, line_lengths[i]);
+    run_isolated(bench_context_switches, 200000);
+    for (int i = 0; i < 4; i++) run_isolated(bench_readline, line_lengths[i]);
+    for (int i = 0; i < 4; i++) run_isolated(bench_print, line_lengths[i]);
+    run_isolated(bench_host_spawn, 200);
+    int pipe_sizes[] = { 0, 64 * 1024, 256 * 1024, 1024 * 1024 };
+    for (int i = 0; i < 4; i++) run_isolated(bench_host_chain, pipe_sizes[i]);
+
+    finish_report();
+    return 0;
+}
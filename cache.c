@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Compiled script cache. The parsed and symbol-resolved AST is written out as one flat array of ASTNodes
+followed by a table of interned strings. Pointers inside the array are stored as index + 1 (string
+pointers as offset + 1), so loading is a single mmap plus one pass to turn those back into pointers -
+nothing is lexed, parsed or allocated.
+
+Cache files are named after a hash of the script contents, the cache format version and the build of the
+interpreter, since they're only meaningful to the build that wrote them - the version only gets bumped by
+hand, and a rebuild can change the node types or their layout without changing its size.
+*/
+
+const int CACHE_FORMAT_VERSION = 10;
+
+struct CacheHeader
+{
+    char magic[4];
+    int format_version;
+    unsigned long long build_id;
+    int node_size;
+    int script_length;
+    unsigned long long script_hash;
+    int n_nodes;
+    int n_symbols;
+    int nodes_offset;
+    int symbols_offset;
+    int strings_offset;
+    int strings_size;
+};
+
+typedef struct CacheHeader CacheHeader;
+
+unsigned long long hash_script(const char *data, int length)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL ^ (unsigned long long) length;
+    int i = 0;
+    while (i + 8 <= length)
+    {
+        unsigned long long word;
+        memcpy(&word, &data[i], 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+        i += 8;
+    }
+    while (i < length)
+    {
+        hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+        i += 1;
+    }
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// when this interpreter was compiled, which is as close to a hash of the binary as we can get for free
+unsigned long long cache_build_id()
+{
+    const char *build = __DATE__ " " __TIME__;
+    return hash_script(build, strlen(build));
+}
+
+int cache_path(char *path, int size, unsigned long long script_hash)
+{
+    unsigned long long key = script_hash ^ ((unsigned long long) CACHE_FORMAT_VERSION * 0x9e3779b97f4a7c15ULL);
+    key ^= cache_build_id() * 0xff51afd7ed558ccdULL;
+
+    char *directory = getenv("CHA_CACHE_DIR");
+    if (directory)
+    {
+        mkdir(directory, 0755);
+        return snprintf(path, size, "%s/%016llx.chc", directory, key) < size;
+    }
+
+    char base[1024];
+    char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (xdg_cache_home)
+    {
+        snprintf(base, sizeof(base), "%s", xdg_cache_home);
+    }
+    else if (home)
+    {
+        snprintf(base, sizeof(base), "%s/.cache", home);
+    }
+    else
+    {
+        return 0;
+    }
+
+    mkdir(base, 0755);
+    int n = snprintf(path, size, "%s/cha", base);
+    if (n >= size) return 0;
+    mkdir(path, 0755);
+
+    return snprintf(path, size, "%s/cha/%016llx.chc", base, key) < size;
+}
+
+struct CacheWriter
+{
+    ASTNode *nodes;
+    int n_nodes;
+    int nodes_capacity;
+
+    char *strings;
+    int strings_size;
+    int strings_capacity;
+
+    // open addressing table of string offsets + 1, so each distinct string is stored once
+    int *interned;
+    int interned_capacity;
+    int n_interned;
+};
+
+typedef struct CacheWriter CacheWriter;
+
+int cache_intern_string(CacheWriter *writer, char *string)
+{
+    unsigned long long hash = hash_script(string, strlen(string));
+
+    if ((writer->n_interned + 1) * 2 > writer->interned_capacity)
+    {
+        int *old = writer->interned;
+        int old_capacity = writer->interned_capacity;
+        writer->interned_capacity = old_capacity ? old_capacity * 2 : 256;
+        writer->interned = calloc(writer->interned_capacity, sizeof(int));
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (!old[i]) continue;
+            char *existing = &writer->strings[old[i] - 1];
+            int slot = hash_script(existing, strlen(existing)) & (writer->interned_capacity - 1);
+            while (writer->interned[slot]) slot = (slot + 1) & (writer->interned_capacity - 1);
+            writer->interned[slot] = old[i];
+        }
+        free(old);
+    }
+
+    int slot = hash & (writer->interned_capacity - 1);
+    while (writer->interned[slot])
+    {
+        int offset = writer->interned[slot] - 1;
+        if (streq(&writer->strings[offset], string)) return offset;
+        slot = (slot + 1) & (writer->interned_capacity - 1);
+    }
+
+    int length = strlen(string) + 1;
+    while (writer->strings_size + length > writer->strings_capacity)
+    {
+        writer->strings_capacity = writer->strings_capacity ? writer->strings_capacity * 2 : 4096;
+        writer->strings = realloc(writer->strings, writer->strings_capacity);
+    }
+
+    int offset = writer->strings_size;
+    memcpy(&writer->strings[offset], string, length);
+    writer->strings_size += length;
+
+    writer->interned[slot] = offset + 1;
+    writer->n_interned += 1;
+
+    return offset;
+}
+
+ASTNode *cache_encode_index(int index)
+{
+    return (ASTNode*) (intptr_t) (index + 1);
+}
+
+int cache_flatten(CacheWriter *writer, ASTNode *node, int parent_index)
+{
+    if (writer->n_nodes == writer->nodes_capacity)
+    {
+        writer->nodes_capacity = writer->nodes_capacity ? writer->nodes_capacity * 2 : 1024;
+        writer->nodes = realloc(writer->nodes, writer->nodes_capacity * sizeof(ASTNode));
+    }
+
+    int index = writer->n_nodes;
+    writer->n_nodes += 1;
+
+    ASTNode *flat = &writer->nodes[index];
+    memset(flat, 0, sizeof(ASTNode));
+    flat->type = node->type;
+    flat->symbol = node->symbol;
+    flat->id = index;
+    flat->source_start = node->source_start;
+    flat->source_end = node->source_end;
+    flat->parent = parent_index == -1 ? 0 : cache_encode_index(parent_index);
+    if (node->type == NUMBER_NODE || node->type == REDIRECT_NODE || node->type == PARALLEL_NODE
+        || node->type == SLEEP_NODE || node->type == TIMEOUT_NODE)
+    {
+        flat->number = node->number;
+    }
+    else if (ast_node_has_string(node->type))
+    {
+        flat->string = (char*) (intptr_t) (cache_intern_string(writer, node->string) + 1);
+    }
+
+    int previous_index = -1;
+    ASTNode *child = node->first_child;
+    while (child)
+    {
+        int child_index = cache_flatten(writer, child, index);
+        if (previous_index == -1)
+        {
+            writer->nodes[index].first_child = cache_encode_index(child_index);
+        }
+        else
+        {
+            writer->nodes[previous_index].next_sibling = cache_encode_index(child_index);
+        }
+
+        previous_index = child_index;
+        child = child->next_sibling;
+    }
+
+    return index;
+}
+
+int write_cache(char *path, ASTNode *program, unsigned long long script_hash, int script_length, char **symbol_names, int n_symbols)
+{
+    CacheWriter writer[1];
+    memset(writer, 0, sizeof(CacheWriter));
+
+    cache_flatten(writer, program, -1);
+
+    int *symbol_offsets = malloc((n_symbols + 1) * sizeof(int));
+    for (int i = 0; i < n_symbols; i++)
+    {
+        symbol_offsets[i] = cache_intern_string(writer, symbol_names[i]);
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CHAC", 4);
+    header.format_version = CACHE_FORMAT_VERSION;
+    header.build_id = cache_build_id();
+    header.node_size = sizeof(ASTNode);
+    header.script_length = script_length;
+    header.script_hash = script_hash;
+    header.n_nodes = writer->n_nodes;
+    header.n_symbols = n_symbols;
+
+    // nodes first so they stay pointer-aligned in the mapping
+    int offset = (sizeof(CacheHeader) + 15) & ~15;
+    header.nodes_offset = offset;
+    offset += writer->n_nodes * sizeof(ASTNode);
+    header.symbols_offset = offset;
+    offset += n_symbols * sizeof(int);
+    header.strings_offset = offset;
+    header.strings_size = writer->strings_size;
+
+    // write to a temporary file and rename it into place, so concurrent runs never see half a cache
+    char temporary_path[1100];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", path, getpid());
+    FILE *file = fopen(temporary_path, "wb");
+    int success = 0;
+    if (file)
+    {
+        char padding[16] = {0};
+        success = fwrite(&header, sizeof(header), 1, file) == 1;
+        int n_padding = header.nodes_offset - sizeof(header);
+        success = success && (n_padding == 0 || fwrite(padding, n_padding, 1, file) == 1);
+        success = success && fwrite(writer->nodes, sizeof(ASTNode), writer->n_nodes, file) == writer->n_nodes;
+        success = success && fwrite(symbol_offsets, sizeof(int), n_symbols, file) == n_symbols;
+        success = success && fwrite(writer->strings, 1, writer->strings_size, file) == writer->strings_size;
+        success = fclose(file) == 0 && success;
+        success = success && rename(temporary_path, path) == 0;
+        if (!success) unlink(temporary_path);
+    }
+
+    free(writer->nodes);
+    free(writer->strings);
+    free(writer->interned);
+    free(symbol_offsets);
+
+    return success;
+}
+
+int cache_decode_node(ASTNode **field, ASTNode *nodes, int n_nodes)
+{
+    if (*field)
+    {
+        intptr_t index = (intptr_t) *field - 1;
+        if (index < 0 || index >= n_nodes) return 0;
+        *field = &nodes[index];
+    }
+
+    return 1;
+}
+
+// 1 = valid, 0 = missing, -1 = stale or corrupt - including having more symbols than the caller has room for
+int load_cache(char *path, unsigned long long script_hash, int script_length, ASTNode **program, char ***symbol_names, int *n_symbols, int max_symbols)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return -1;
+    }
+
+    char *base = mmap(0, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    CacheHeader *header = (CacheHeader*) base;
+    int valid = memcmp(header->magic, "CHAC", 4) == 0
+        && header->format_version == CACHE_FORMAT_VERSION
+        && header->build_id == cache_build_id()
+        && header->node_size == sizeof(ASTNode)
+        && header->script_length == script_length
+        && header->script_hash == script_hash
+        && header->n_nodes > 0
+        && header->n_symbols >= 0 && header->n_symbols <= max_symbols
+        && header->nodes_offset + (long) header->n_nodes * sizeof(ASTNode) <= header->symbols_offset
+        && header->symbols_offset + (long) header->n_symbols * sizeof(int) <= header->strings_offset
+        && header->strings_offset + (long) header->strings_size == info.st_size
+        && header->strings_size > 0 && base[info.st_size - 1] == 0;
+
+    if (!valid)
+    {
+        munmap(base, info.st_size);
+        return -1;
+    }
+
+    ASTNode *nodes = (ASTNode*) (base + header->nodes_offset);
+    char *strings = base + header->strings_offset;
+    int n_nodes = header->n_nodes;
+
+    for (int i = 0; i < n_nodes && valid; i++)
+    {
+        ASTNode *node = &nodes[i];
+        valid = cache_decode_node(&node->parent, nodes, n_nodes)
+            && cache_decode_node(&node->first_child, nodes, n_nodes)
+            && cache_decode_node(&node->next_sibling, nodes, n_nodes);
+
+        // names are looked up by index from here on, so one past the end of the table would go unnoticed
+        if (node->type == NAME_NODE && node->symbol >= header->n_symbols) valid = 0;
+
+        if (valid && ast_node_has_string(node->type))
+        {
+            intptr_t offset = (intptr_t) node->string - 1;
+            if (offset < 0 || offset >= header->strings_size) valid = 0;
+            else node->string = strings + offset;
+        }
+    }
+
+    int *symbol_offsets = (int*) (base + header->symbols_offset);
+    *symbol_names = malloc((header->n_symbols + 1) * sizeof(char*));
+    for (int i = 0; i < header->n_symbols && valid; i++)
+    {
+        if (symbol_offsets[i] < 0 || symbol_offsets[i] >= header->strings_size) valid = 0;
+        else (*symbol_names)[i] = strings + symbol_offsets[i];
+    }
+
+    if (!valid)
+    {
+        free(*symbol_names);
+        munmap(base, info.st_size);
+        return -1;
+    }
+
+    *n_symbols = header->n_symbols;
+    *program = &nodes[0];
+    return 1;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+Waiting on host processes. Their pipes are non-blocking, and a read or write that comes back with EAGAIN marks
+the fd as waiting, after which it isn't tried again until the kernel says it's ready - so a process that has
+nothing to say costs nothing per scheduler pass. When a whole pass goes by without any thread getting anywhere,
+the scheduler sleeps in hostio_wait until one of the waiting fds is ready, instead of spinning.
+
+With io_uring, each waiting fd gets a poll request that stays armed across waits, so a wait only submits the
+fds that started waiting since the last one, in the same io_uring_enter that sleeps. Without it (or with
+CHA_NO_IO_URING set) every wait is one poll() over all the waiting fds.
+
+Processes exiting are waited on through pidfds, where the kernel has them.
+*/
+
+const int HOSTIO_RING_ENTRIES = 256;
+
+// user_data of requests whose completions nobody looks at, eg. poll removals
+const unsigned long long HOSTIO_IGNORED = ~0ULL;
+
+struct HostIOFd
+{
+    short waiting_events; // 0 = not waiting, so worth trying
+    int armed; // has a poll request in the ring
+    unsigned generation; // of the last poll request, so that completions of old ones can be told apart
+};
+
+typedef struct HostIOFd HostIOFd;
+
+HostIOFd *hostio_fds = 0;
+int hostio_fds_capacity = 0;
+int hostio_n_waiting = 0;
+
+long hostio_n_waits = 0;
+long hostio_n_submitted = 0;
+
+struct HostIORing
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+typedef struct HostIORing HostIORing;
+
+HostIORing hostio_ring = { .fd = -1 };
+int hostio_initialised = 0;
+int hostio_pidfds_supported = 1;
+
+int hostio_ring_setup()
+{
+    if (getenv("CHA_NO_IO_URING")) return 0;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, HOSTIO_RING_ENTRIES, &params);
+    if (fd == -1) return 0;
+
+    // waits need a timeout of their own, rather than a timeout request that could outlive them
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        return 0;
+    }
+
+    int sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    int cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+
+    struct io_uring_sqe *sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        munmap(ring, ring_size);
+        close(fd);
+        return 0;
+    }
+
+    HostIORing *r = &hostio_ring;
+    r->fd = fd;
+    r->sq_head = (unsigned*) (ring + params.sq_off.head);
+    r->sq_tail = (unsigned*) (ring + params.sq_off.tail);
+    r->sq_mask = *(unsigned*) (ring + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (ring + params.sq_off.array);
+    r->sqes = sqes;
+    r->cq_head = (unsigned*) (ring + params.cq_off.head);
+    r->cq_tail = (unsigned*) (ring + params.cq_off.tail);
+    r->cq_mask = *(unsigned*) (ring + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    return 1;
+}
+
+void hostio_initialise()
+{
+    if (hostio_initialised) return;
+    hostio_initialised = 1;
+    hostio_ring_setup();
+}
+
+const char *hostio_backend_name()
+{
+    return hostio_ring.fd != -1 ? "io_uring" : "poll";
+}
+
+HostIOFd *hostio_fd(int fd)
+{
+    if (fd >= hostio_fds_capacity)
+    {
+        int capacity = hostio_fds_capacity ? hostio_fds_capacity : 64;
+        while (capacity <= fd) capacity *= 2;
+        hostio_fds = realloc(hostio_fds, capacity * sizeof(HostIOFd));
+        memset(&hostio_fds[hostio_fds_capacity], 0, (capacity - hostio_fds_capacity) * sizeof(HostIOFd));
+        hostio_fds_capacity = capacity;
+    }
+
+    return &hostio_fds[fd];
+}
+
+// queued requests the kernel hasn't taken yet
+unsigned hostio_ring_n_unsubmitted()
+{
+    return *hostio_ring.sq_tail - __atomic_load_n(hostio_ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+int hostio_ring_enter(unsigned n_wait, int timeout_ms)
+{
+    HostIORing *r = &hostio_ring;
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long long) (unsigned long) &timeout;
+
+    unsigned flags = n_wait > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    return syscall(__NR_io_uring_enter, r->fd, hostio_ring_n_unsubmitted(), n_wait, flags, n_wait > 0 ? (void*) &arg : 0, sizeof(arg));
+}
+
+struct io_uring_sqe *hostio_ring_get_sqe()
+{
+    HostIORing *r = &hostio_ring;
+    // full, so whatever is queued has to go in first
+    if (hostio_ring_n_unsubmitted() > r->sq_mask) hostio_ring_enter(0, 0);
+
+    unsigned tail = *r->sq_tail;
+
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    hostio_n_submitted += 1;
+    return sqe;
+}
+
+unsigned long long hostio_user_data(int fd, unsigned generation)
+{
+    return ((unsigned long long) generation << 32) | (unsigned) fd;
+}
+
+// the poll requests that have fired are done with, and their fds are worth trying again
+void hostio_ring_reap()
+{
+    HostIORing *r = &hostio_ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        head += 1;
+        if (cqe->user_data == HOSTIO_IGNORED || cqe->res == -ECANCELED) continue;
+
+        int fd = (int) (cqe->user_data & 0xffffffff);
+        unsigned generation = (unsigned) (cqe->user_data >> 32);
+        if (fd >= hostio_fds_capacity) continue;
+
+        HostIOFd *state = &hostio_fds[fd];
+        if (!state->armed || state->generation != generation) continue;
+        state->armed = 0;
+        if (state->waiting_events) hostio_n_waiting -= 1;
+        state->waiting_events = 0;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// a read or write on fd came back with EAGAIN
+void hostio_would_block(int fd, short events)
+{
+    HostIOFd *state = hostio_fd(fd);
+    if (!state->waiting_events) hostio_n_waiting += 1;
+    state->waiting_events = events;
+}
+
+int hostio_is_ready(int fd)
+{
+    return fd >= hostio_fds_capacity || !hostio_fds[fd].waiting_events;
+}
+
+void hostio_forget(int fd)
+{
+    if (fd < 0 || fd >= hostio_fds_capacity) return;
+
+    HostIOFd *state = &hostio_fds[fd];
+    if (state->armed)
+    {
+        // the poll request holds on to the file, which would keep the pipe open for the process at the other end
+        struct io_uring_sqe *sqe = hostio_ring_get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = hostio_user_data(fd, state->generation);
+        sqe->user_data = HOSTIO_IGNORED;
+        hostio_ring_enter(0, 0);
+        hostio_ring_reap();
+        state->armed = 0;
+    }
+    if (state->waiting_events) hostio_n_waiting -= 1;
+    state->waiting_events = 0;
+}
+
+// every fd used with hostio_would_block has to be closed through here
+void hostio_close(int fd)
+{
+    hostio_forget(fd);
+    close(fd);
+}
+
+/*
+State is kept by fd number, so a new fd starts out with whatever was left behind by an earlier one with the
+same number that was closed without going through hostio_close - a waiting flag that would make it look
+blocked, or worse a poll request that keeps the old file open. Every fd that may go to hostio_would_block
+is adopted first, so that can't outlive the fd it was about.
+*/
+void hostio_adopt(int fd)
+{
+    hostio_forget(fd);
+}
+
+void hostio_wait_ring(int timeout_ms)
+{
+    for (int fd = 0; fd < hostio_fds_capacity; fd++)
+    {
+        HostIOFd *state = &hostio_fds[fd];
+        if (!state->waiting_events || state->armed) continue;
+
+        state->generation += 1;
+        state->armed = 1;
+        struct io_uring_sqe *sqe = hostio_ring_get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = state->waiting_events;
+        sqe->user_data = hostio_user_data(fd, state->generation);
+    }
+
+    hostio_ring_enter(1, timeout_ms);
+
+    hostio_ring_reap();
+}
+
+struct pollfd *hostio_pollfds = 0;
+int hostio_pollfds_capacity = 0;
+
+void hostio_wait_poll(int timeout_ms)
+{
+    if (hostio_n_waiting > hostio_pollfds_capacity)
+    {
+        hostio_pollfds_capacity = hostio_n_waiting * 2;
+        hostio_pollfds = realloc(hostio_pollfds, hostio_pollfds_capacity * sizeof(struct pollfd));
+    }
+    struct pollfd *fds = hostio_pollfds;
+
+    int n_fds = 0;
+    for (int fd = 0; fd < hostio_fds_capacity && n_fds < hostio_n_waiting; fd++)
+    {
+        if (!hostio_fds[fd].waiting_events) continue;
+        fds[n_fds].fd = fd;
+        fds[n_fds].events = hostio_fds[fd].waiting_events;
+        fds[n_fds].revents = 0;
+        n_fds += 1;
+    }
+
+    if (poll(fds, n_fds, timeout_ms) <= 0) return;
+
+    for (int i = 0; i < n_fds; i++)
+    {
+        if (!fds[i].revents) continue;
+        hostio_fds[fds[i].fd].waiting_events = 0;
+        hostio_n_waiting -= 1;
+    }
+}
+
+// until at least one waiting fd is ready or timeout_ms is up, whichever comes first. Returns straight away if
+// nothing is waiting, since then there's nothing for the kernel to wake us up for
+void hostio_wait(int timeout_ms)
+{
+    if (hostio_n_waiting == 0) return;
+
+    hostio_n_waits += 1;
+    if (hostio_ring.fd != -1) hostio_wait_ring(timeout_ms);
+    else hostio_wait_poll(timeout_ms);
+}
+
+// an fd that becomes readable once the process has exited, or -1
+int hostio_open_pidfd(int pid)
+{
+#ifdef __NR_pidfd_open
+    if (hostio_pidfds_supported)
+    {
+        int fd = syscall(__NR_pidfd_open, pid, 0);
+        if (fd != -1) return fd;
+        if (errno == ENOSYS) hostio_pidfds_supported = 0;
+    }
+#else
+    hostio_pidfds_supported = 0;
+#endif
+    return -1;
+}
@@ -3,11 +3,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <wait.h>
+#include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
 
 #include "parser.c"
 #include "pipes.c"
+#include "hostio.c"
+#include "timers.c"
+#include "cache.c"
+#include "trace.c"
+#include "profile.c"
 
 struct POSIXPipe
 {
@@ -17,8 +31,21 @@ struct POSIXPipe
 
 typedef struct POSIXPipe POSIXPipe;
 
-const int GLOBAL_HOST_READ_BUFFER_SIZE = 1024;
-char GLOBAL_HOST_READ_BUFFER[GLOBAL_HOST_READ_BUFFER_SIZE];
+/*
+How big host processes' stdin and stdout pipes are made (CHA_PIPE_SIZE, 0 to leave them as the kernel makes
+them), and our own pipes that only go between host processes, so that a process with a lot to say is
+emptied in a few big reads rather than a PIPE_BUFFER_SIZE handful per resume. The kernel caps it at
+/proc/sys/fs/pipe-max-size for anyone unprivileged.
+*/
+int host_pipe_size = 256 * 1024;
+
+// what a host pipe holds if it can't be resized
+const int HOST_DEFAULT_PIPE_SIZE = 64 * 1024;
+
+// for host output that goes straight to our stdout - it starts small and doubles every time a read fills it,
+// up to the size of the pipe it's read from
+char *host_read_buffer = 0;
+int host_read_buffer_capacity = 0;
 
 struct EvaluationContext
 {
@@ -36,6 +63,17 @@ struct InterpreterThread
     int n_pending_children;
     int finished;
 
+    // jobs started with & count as pending children too, but only hold the thread up at a wait (and at the end,
+    // so that nothing they use is closed under them)
+    int is_background;
+    int n_background_jobs;
+    int waiting_for_jobs;
+
+    int timer; // for a sleep, or -1
+    int sleeping; // until the timer goes off, and it isn't resumed before then
+    int timeout_timer; // for the timeout around whatever the thread is doing, or -1
+    int timed_out; // the timeout went off, so nothing else gets started until it's over
+
     ASTNode *root;
     ASTNode *current;
     EvaluationContext context_stack[32];
@@ -47,9 +85,72 @@ struct InterpreterThread
 
     PipeBuffer *write_pipe;
     PipeBuffer *read_pipe;
+    int read_cursor; // which of read_pipe's readers this thread is - always 0 unless it's behind a tee
+    PipeBuffer *error_pipe; // where the stderr of its host processes goes, for !|
+
+    // ends of a kernel pipe joining two host processes with !|, held only until the process is started
+    int error_pipe_in;
+    int error_pipe_out;
+
+    // files from -> and <-, or -1 where the stream isn't redirected. Host processes are given these fds as they
+    // are, while the script's own prints go through output_file and its reads through input_file
+    int stdin_file;
+    int stdout_file;
+    int stderr_file;
+    FILE *output_file;
+    InputBuffer *input_file;
+
+    // where output goes inside ${ ... }, ahead of output_file. captures are the ones this thread is waiting on,
+    // one per substitution in the expression or command it's at
+    CaptureBuffer *capture;
+    CaptureBuffer **captures;
+    int n_captures;
+
+    struct ParallelStage *parallel; // while it's the dispatcher of a parallel statement
+
+    // the pipes joining the stages of the last pipeline it started, given back once all the stages are done
+    PipeBuffer *pipeline_pipes[32];
+    int n_pipeline_pipes;
+
+    // the file this thread opened for a redirected statement, closed again once that statement is done
+    int redirect_fd;
+    FILE *redirect_output;
+    InputBuffer *redirect_input;
 
     int host_write;
     int host_read;
+    int host_input_finished;
+    int host_output_finished;
+    int host_errors;
+    int host_errors_finished;
+    int host_pipe_capacity; // of the host_read and host_write pipes
+    int host_pidfd; // or -1, in which case it's only noticed that the process has exited by asking
+
+    int print_offset;
+    int repeating_current_node; // resume_execution left off at a node it has to run again, eg. a blocked print
+
+    // the pipe the thread is waiting to read from or write to, if any - see thread_is_ready
+    PipeBuffer *blocked_pipe;
+    enum BlockReason blocked_reason;
+    long blocked_pipe_bytes_written;
+
+    int quantum;
+
+    // for loops hand out lines in place, so the current one is only consumed when the next one is asked for
+    int n_held_bytes;
+    struct Value *line_view;
+    char *line_copy;
+    int line_copy_capacity;
+    int n_partial_line_bytes; // already taken out of the pipe, of a line that didn't fit in it
+
+    // variables are shared by every thread, so the one a for loop is on is put back whenever the thread
+    // resumes - otherwise two threads running the same loop would see each other's lines
+    ASTNode *loop_name;
+    struct Value *loop_value;
+
+    double host_started;
+    int host_stats_index;
+    ThreadStats stats;
 };
 
 typedef struct InterpreterThread InterpreterThread;
@@ -57,6 +158,27 @@ typedef struct InterpreterThread InterpreterThread;
 InterpreterThread thread_pool[64];
 int n_threads = 0;
 
+// slots of threads that have finished and been detached from their parents, reused before any new ones
+int free_threads[64];
+int n_free_threads = 0;
+
+// across all threads, so the scheduler can tell a pass in which nobody got anywhere
+long n_productive_resumes = 0;
+long scheduler_n_resumes = 0; // likewise, for bench/pipes.c to count context switches with
+
+// what a thread's timer going off means - the end of a sleep, or the end of a timeout's process
+const int TIMER_WAKE = 0;
+const int TIMER_KILL = 1;
+
+/*
+How many nodes a thread may execute in one resume_execution before it's preempted at the next loop
+back-edge. Threads that keep using up their whole quantum get it doubled, up to SCHEDULER_MAX_QUANTUM_SCALE
+times the base, so compute-heavy stages pay less scheduling overhead; as soon as a thread blocks it goes
+back to the base quantum. 0 turns preemption off.
+*/
+int scheduler_quantum = 4096;
+const int SCHEDULER_MAX_QUANTUM_SCALE = 16;
+
 enum ValueType
 {
     VALUE_TYPE_STRING,
@@ -73,6 +195,7 @@ struct Value
         int integer_value;
         int boolean_value;
     };
+    int is_view; // string_value points into a pipe or the stdin buffer and is only good until the next line
 };
 
 typedef struct Value Value;
@@ -91,214 +214,614 @@ int n_symbols = 0;
 Value *alloc_value(int type)
 {
     Value *value = malloc(sizeof(Value));
+    allocation_stats.n_values += 1;
+    allocation_stats.value_bytes += sizeof(Value);
+    if (profile_enabled) profile_count_allocation(sizeof(Value));
     value->type = type;
+    value->is_view = 0;
     return value;
 }
 
-void set_symbol(char *name, Value *value)
+const int SYMBOL_TRUE = -2;
+const int SYMBOL_FALSE = -3;
+
+int resolve_symbol(char *name)
 {
-    int i;
-    for (i = 0; i < n_symbols; i++)
+    if (streq(name, "true")) return SYMBOL_TRUE;
+    if (streq(name, "false")) return SYMBOL_FALSE;
+
+    for (int i = 0; i < n_symbols; i++)
     {
         char *symbol_name = symbol_table[i].name;
-        if (streq(symbol_name, name))
-        {
-            break;
-        }
+        if (streq(symbol_name, name)) return i;
     }
 
-    symbol_table[i].name = name;
-    symbol_table[i].value = value;
-    
-    if (i == n_symbols) n_symbols += 1;
+    if (n_symbols >= sizeof(symbol_table) / sizeof(symbol_table[0]))
+    {
+        printf("ERROR: Too many variables (%s:%d)\n", __FILE__, __LINE__);
+        return -1;
+    }
+
+    symbol_table[n_symbols].name = name;
+    symbol_table[n_symbols].value = 0;
+    n_symbols += 1;
+    return n_symbols - 1;
 }
 
-Value *readline(InterpreterThread *thread)
+// give every variable reference a slot up front so the interpreter never has to look names up
+void resolve_symbols(ASTNode *node)
 {
-    char buffer[128];
-    
-    if (thread->read_pipe)
+    if (node->type == NAME_NODE)
     {
-        PipeBuffer *read_pipe = thread->read_pipe;
-        if (read_pipe->closed)
-        {
-            Value *value = alloc_value(VALUE_TYPE_BOOLEAN);
-            value->boolean_value = 0;
-            return value;
-        }
+        node->symbol = resolve_symbol(node->name);
+    }
 
-        if (!pipe_read_line(read_pipe, buffer)) return 0;
+    ASTNode *child = node->first_child;
+    while (child)
+    {
+        resolve_symbols(child);
+        child = child->next_sibling;
     }
-    else
+}
+
+void set_symbol(int symbol, Value *value)
+{
+    if (symbol < 0)
+    {
+        printf("ERROR: Cannot assign to \"%s\"\n", symbol == SYMBOL_TRUE ? "true" : "false");
+        return;
+    }
+
+    symbol_table[symbol].value = value;
+}
+
+InputBuffer *thread_input(InterpreterThread *thread)
+{
+    return thread->input_file ? thread->input_file : &stdin_buffer;
+}
+
+void thread_release_line(InterpreterThread *thread)
+{
+    if (!thread->n_held_bytes) return;
+
+    if (thread->read_pipe) pipe_consume(thread->read_pipe, thread->read_cursor, thread->n_held_bytes);
+    else input_buffer_consume(thread_input(thread), thread->n_held_bytes);
+    thread->n_held_bytes = 0;
+}
+
+// for when a host process is about to take over the input in the middle of a for loop - the current line
+// moves into the thread's own copy, so the process starts after it and the loop can still use it
+void thread_detach_line(InterpreterThread *thread)
+{
+    if (!thread->n_held_bytes) return;
+
+    if (thread->line_view && thread->line_view->string_value != thread->line_copy)
     {
-        int i = 0;
-        while (1)
+        int length = strlen(thread->line_view->string_value);
+        if (length + 1 > thread->line_copy_capacity)
         {
-            int success = read(STDIN_FILENO, &buffer[i], 1);
-            if (!success)
-            {
-                // printf("ERROR: Ran out of input reading a line from stdin (%s:%d)\n", __FILE__, __LINE__);
-                // out of input
-                buffer[i] = 0;
-                break;
-            }
+            thread->line_copy_capacity = length + 1;
+            thread->line_copy = realloc(thread->line_copy, thread->line_copy_capacity);
+        }
+        memcpy(thread->line_copy, thread->line_view->string_value, length + 1);
+        thread->line_view->string_value = thread->line_copy;
+    }
 
-            if (buffer[i] == '\n')
-            {
-                buffer[i] = 0;
-                break;
-            }
+    thread_release_line(thread);
+}
 
-            i += 1;
+// 1 = *line is the next line, 0 = not there yet, -1 = end of input
+int thread_next_line_view(InterpreterThread *thread, char **line)
+{
+    thread_release_line(thread);
 
-            if (i >= sizeof(buffer))
+    if (thread->read_pipe)
+    {
+        int n_bytes = pipe_peek_line(thread->read_pipe, thread->read_cursor, line, &thread->line_copy, &thread->line_copy_capacity, &thread->n_partial_line_bytes);
+        if (n_bytes == 0) return thread->read_pipe->closed ? -1 : 0;
+        thread->n_held_bytes = n_bytes;
+        return 1;
+    }
+
+    int n_bytes = input_buffer_peek_line(thread_input(thread), line);
+    if (n_bytes == 0) return -1;
+    thread->n_held_bytes = n_bytes;
+    return 1;
+}
+
+Value *readline(InterpreterThread *thread)
+{
+    // out of input reads as an empty line
+    char *line = "";
+
+    thread_release_line(thread);
+
+    if (thread->read_pipe)
+    {
+        PipeBuffer *read_pipe = thread->read_pipe;
+        int n_bytes = pipe_peek_line(read_pipe, thread->read_cursor, &line, &thread->line_copy, &thread->line_copy_capacity, &thread->n_partial_line_bytes);
+        if (n_bytes == 0)
+        {
+            // the writer may have closed the pipe straight after its last line, so only report the end
+            // of the stream once there's nothing left to read
+            if (read_pipe->closed)
             {
-                printf("ERROR: Buffer cannot hold line from stdin (%s:%d)\n", __FILE__, __LINE__);
-                break;
+                Value *value = alloc_value(VALUE_TYPE_BOOLEAN);
+                value->boolean_value = 0;
+                return value;
             }
+
+            return 0;
         }
+
+        Value *value = alloc_value(VALUE_TYPE_STRING);
+        value->string_value = save_string_to_heap(line);
+        if (profile_enabled) profile_count_allocation(strlen(line) + 1);
+        pipe_consume(read_pipe, thread->read_cursor, n_bytes);
+        return value;
     }
 
-    Value *value = alloc_value(VALUE_TYPE_STRING);
-    value->string_value = save_string_to_heap(buffer);
+    InputBuffer *input = thread_input(thread);
+    int n_bytes = input_buffer_peek_line(input, &line);
+    input_buffer_consume(input, n_bytes);
 
+    Value *value = alloc_value(VALUE_TYPE_STRING);
+    value->string_value = save_string_to_heap(line);
+    if (profile_enabled) profile_count_allocation(strlen(line) + 1);
     return value;
 }
 
-Value *lookup_symbol(char *name)
+Value *lookup_symbol(ASTNode *node)
 {
-    if (streq(name, "true"))
+    if (node->symbol == SYMBOL_TRUE)
     {
         Value *value = alloc_value(VALUE_TYPE_BOOLEAN);
         value->boolean_value = 1;
         return value;
     }
-    else if (streq(name, "false"))
+    else if (node->symbol == SYMBOL_FALSE)
     {
         Value *value = alloc_value(VALUE_TYPE_BOOLEAN);
         value->boolean_value = 0;
         return value;
     }
 
-    for (int i = 0; i < n_symbols; i++)
+    if (node->symbol >= 0 && symbol_table[node->symbol].value)
     {
-        char *symbol_name = symbol_table[i].name;
-        if (streq(symbol_name, name)) return symbol_table[i].value;
+        return symbol_table[node->symbol].value;
     }
 
-    printf("ERROR: Undefined variable \"%s\"\n", name);
+    printf("ERROR: Undefined variable \"%s\"\n", node->name);
     return 0;
 }
 
-void thread_read_from_host(InterpreterThread *thread)
+/*
+SIGPIPE is ignored so that host processes going away can't take us down with them, which means our own
+stdout going away has to be noticed by hand. Nobody is listening any more, so there's nothing left to do.
+*/
+void exit_if_stdout_closed()
+{
+    if (errno == EPIPE) exit(128 + SIGPIPE);
+}
+
+int thread_read_from_host(InterpreterThread *thread)
 {
+    if (!hostio_is_ready(thread->host_read)) return 0;
+
+    int n_moved = 0;
+    int result;
     if (thread->write_pipe)
     {
         PipeBuffer *pipe = thread->write_pipe;
-        
-        int result = read(thread->host_read, pipe->unsent_data, PIPE_BUFFER_SIZE);
-        if (result != -1)
+        if (pipe_free_space(pipe) == 0)
+        {
+            pipe_count_full(pipe);
+            return 0;
+        }
+
+        result = pipe_read_from_fd(pipe, thread->host_read);
+        if (result > 0)
         {
             // result is number of bytes
-            pipe->n_unsent_bytes = result;
-            pipe_try_to_flush_unsent(pipe);
+            n_moved = result;
+        }
+        else if (result == 0)
+        {
+            thread->host_output_finished = 1;
         }
     }
+    else if (thread->capture)
+    {
+        result = capture_buffer_read(thread->capture, thread->host_read);
+        if (result > 0) n_moved = result;
+        else if (result == 0) thread->host_output_finished = 1;
+    }
     else
     {
-        int result = read(thread->host_read, GLOBAL_HOST_READ_BUFFER, GLOBAL_HOST_READ_BUFFER_SIZE);
-        if (result != -1)
+        if (!host_read_buffer)
         {
-            // result is number of bytes
-            write(STDOUT_FILENO, GLOBAL_HOST_READ_BUFFER, result);
+            host_read_buffer_capacity = PIPE_BUFFER_SIZE;
+            host_read_buffer = malloc(host_read_buffer_capacity);
         }
-        else
+
+        result = read(thread->host_read, host_read_buffer, host_read_buffer_capacity);
+        if (result > 0)
         {
-            // printf("%s\n", strerror(errno));
+            // result is number of bytes - anything we've printed ourselves has to go out first
+            fflush(stdout);
+            if (write(STDOUT_FILENO, host_read_buffer, result) == -1) exit_if_stdout_closed();
+            n_moved = result;
+
+            if (result == host_read_buffer_capacity && host_read_buffer_capacity < thread->host_pipe_capacity)
+            {
+                host_read_buffer_capacity *= 2;
+                host_read_buffer = realloc(host_read_buffer, host_read_buffer_capacity);
+            }
+        }
+        else if (result == 0)
+        {
+            thread->host_output_finished = 1;
         }
     }
+
+    if (result == -1 && errno == EAGAIN) hostio_would_block(thread->host_read, POLLIN);
+
+    if (thread->host_output_finished)
+    {
+        hostio_close(thread->host_read);
+    }
+
+    return n_moved;
 }
 
-void thread_write_to_host(InterpreterThread *thread)
+// same as the write_pipe half of thread_read_from_host, but for stderr - it has its own pipe, so neither
+// stream ever has to wait for room in the other
+int thread_read_errors_from_host(InterpreterThread *thread)
 {
-    int n_read;
-    char *buffer;
+    if (!hostio_is_ready(thread->host_errors)) return 0;
+
+    PipeBuffer *pipe = thread->error_pipe;
+    if (pipe_free_space(pipe) == 0)
+    {
+        pipe_count_full(pipe);
+        return 0;
+    }
+
+    int result = pipe_read_from_fd(pipe, thread->host_errors);
+    if (result > 0) return result;
 
+    if (result == 0)
+    {
+        hostio_close(thread->host_errors);
+        thread->host_errors_finished = 1;
+    }
+    else if (errno == EAGAIN)
+    {
+        hostio_would_block(thread->host_errors, POLLIN);
+    }
+
+    return 0;
+}
+
+// the process has stopped reading, so whatever is upstream of it can stop too
+void thread_host_stopped_reading(InterpreterThread *thread)
+{
+    hostio_close(thread->host_write);
+    thread->host_input_finished = 1;
+
+    // unless it's only one of the things the thread does with its input, eg. a command run once per line
+    if (thread->read_pipe && thread->root->type == HOST_NODE) pipe_close_reader(thread->read_pipe, thread->read_cursor);
+}
+
+/*
+The process's stdin is non-blocking on our end: if it isn't reading, because it's stuck writing output we
+haven't collected yet, this has to come back and collect it rather than wait. So nothing is taken from the
+pipe or input buffer until it has actually been written.
+*/
+int thread_write_to_host(InterpreterThread *thread)
+{
+    struct iovec pieces[2];
+    int n_pieces;
+
+    if (thread->host_input_finished) return 0;
+    if (!hostio_is_ready(thread->host_write)) return 0;
+
+    InputBuffer *input = 0;
     if (thread->read_pipe)
     {   
-        buffer = GLOBAL_PIPE_READ_BUFFER;
-        n_read = pipe_read(thread->read_pipe);        
+        // the whole of what's unread, even if it wraps around the end of the ring
+        n_pieces = pipe_peek_all(thread->read_pipe, thread->read_cursor, pieces);
 
-        if (n_read == 0)
+        if (n_pieces == 0)
         {
             if (thread->read_pipe->closed)
             {
-                close(thread->host_write);
-                return;
+                hostio_close(thread->host_write);
+                thread->host_input_finished = 1;
             }
+            return 0;
         }
     }
     else
     {
-        // this is for if we're piping input right into the script from the command line
-        buffer = GLOBAL_HOST_READ_BUFFER;
-        n_read = read(STDIN_FILENO, GLOBAL_HOST_READ_BUFFER, GLOBAL_HOST_READ_BUFFER_SIZE);
-        // printf("%d\n", n_read);
-        if (n_read == 0)
+        // this is for if we're piping input right into the script from the command line (or from a file
+        // that couldn't be handed over as it was) - whatever the script has already buffered up but not used
+        // goes first
+        input = thread_input(thread);
+        if (input->start == input->end && !input->sendfile_unsupported)
         {
-            close(thread->host_write);
-            return;
+            // files go from the page cache straight into the process's pipe, without coming through here
+            // as much as the process's stdin pipe holds, so sendfile never has to wait for it to read
+            int n_sent = sendfile(thread->host_write, input->fd, 0, thread->host_pipe_capacity);
+            if (n_sent > 0) return n_sent;
+            if (n_sent == -1 && errno == EAGAIN)
+            {
+                hostio_would_block(thread->host_write, POLLOUT);
+                return 0;
+            }
+            if (n_sent == -1 && errno == EPIPE)
+            {
+                thread_host_stopped_reading(thread);
+                return 0;
+            }
+            if (n_sent == -1 && (errno == EINVAL || errno == ENOSYS)) input->sendfile_unsupported = 1;
+            else input->finished = 1;
         }
+
+        if (input->start == input->end && !input->finished) input_buffer_fill(input);
+
+        if (input->end == input->start)
+        {
+            if (input->finished)
+            {
+                hostio_close(thread->host_write);
+                thread->host_input_finished = 1;
+            }
+            return 0;
+        }
+
+        pieces[0].iov_base = &input->data[input->start];
+        pieces[0].iov_len = input->end - input->start;
+        n_pieces = 1;
     }
 
-    int n_written = write(thread->host_write, buffer, n_read);
+    int n_written = writev(thread->host_write, pieces, n_pieces);
 
-    if (n_written < n_read)
+    if (n_written == -1)
     {
-        // host error, shouldn't happen
-        printf("ERROR: Could not write to host process (%s:%d)\n", __FILE__, __LINE__);
+        if (errno == EPIPE) thread_host_stopped_reading(thread);
+        else if (errno == EAGAIN) hostio_would_block(thread->host_write, POLLOUT);
+        else printf("ERROR: Could not write to host process (%s:%d)\n", __FILE__, __LINE__);
+        return 0;
     }
+
+    if (input) input_buffer_consume(input, n_written);
+    else pipe_consume(thread->read_pipe, thread->read_cursor, n_written);
+
+    return n_written;
 }
 
 // incomplete: this never returns 0 if it's outputting to stdout, but probably stdout can get clogged too?
+// 1 = printed, 0 = the pipe is full so try again later, -1 = nobody is reading the pipe any more
 int print(InterpreterThread *thread, Value *value)
 {
-    char temp[256];
+    char temp[32];
+    char *text = temp;
 
     if (value->type == VALUE_TYPE_STRING)
     {
-        sprintf(temp, "%s\n", value->string_value);
+        text = value->string_value;
     }
     else if (value->type == VALUE_TYPE_NUMBER)
     {
-        sprintf(temp, "%d\n", value->integer_value);
+        sprintf(temp, "%d", value->integer_value);
     }
     else if (value->type == VALUE_TYPE_BOOLEAN)
     {
         if (value->boolean_value)
         {
-            sprintf(temp, "true\n");
+            sprintf(temp, "true");
         }
         else
         {
-            sprintf(temp, "false\n");
+            sprintf(temp, "false");
+        }
+    }
+
+    int length = strlen(text);
+
+    if (thread->write_pipe == 0 && thread->capture)
+    {
+        capture_buffer_write(thread->capture, text, length);
+        capture_buffer_write(thread->capture, "\n", 1);
+        return 1;
+    }
+
+    if (thread->write_pipe == 0 && thread->output_file)
+    {
+        FILE *file = thread->output_file;
+        if (fwrite(text, 1, length, file) < length || putc('\n', file) == EOF)
+        {
+            printf("ERROR: Could not write to file (%s) (%s:%d)\n", strerror(errno), __FILE__, __LINE__);
         }
+        return 1;
     }
 
     if (thread->write_pipe == 0)
     {
-        printf("%s", temp);
+        if (fwrite(text, 1, length, stdout) < length || putc('\n', stdout) == EOF) exit_if_stdout_closed();
+        return 1;
     }
-    else
+
+    PipeBuffer *pipe = thread->write_pipe;
+    if (pipe->reader_closed) return -1;
+    return pipe_write_line(pipe, text, length, &thread->print_offset);
+}
+
+// trailing newlines are dropped, like in any other shell. The string takes over the capture's memory as it is
+char *capture_to_string(CaptureBuffer *capture)
+{
+    capture_buffer_reserve(capture, 0);
+    while (capture->size > 0 && capture->data[capture->size - 1] == '\n') capture->size -= 1;
+    capture->data[capture->size] = 0;
+
+    char *string = capture->data;
+    allocation_stats.n_strings += 1;
+    allocation_stats.string_bytes += capture->capacity;
+    if (profile_enabled) profile_count_allocation(capture->capacity);
+    free(capture);
+    return string;
+}
+
+/*
+Every HOST_NODE gets its argv built once, the first time it runs. Constant arguments point straight at the
+AST's strings, and only $name and ${ ... } arguments are slots to be filled in at launch. A variable is only
+turned back into text when it holds a different value than last time, into a buffer the slot keeps for good,
+so a command run once per line of input doesn't allocate anything for its arguments.
+*/
+struct HostArgumentSlot
+{
+    ASTNode *node; // NAME_NODE or SUBSTITUTION_NODE
+    int index;
+    Value *value; // what the buffer was last filled from
+    char *buffer;
+    int capacity;
+};
+
+typedef struct HostArgumentSlot HostArgumentSlot;
+
+struct HostArgvTemplate
+{
+    char **arguments; // with room for the NULL at the end
+    int n_arguments;
+    HostArgumentSlot *slots;
+    int n_slots;
+    int n_substitutions;
+
+    // run by a for loop over the same input, so the process mustn't be fed the lines the loop hasn't got to yet
+    int inside_for_loop;
+};
+
+typedef struct HostArgvTemplate HostArgvTemplate;
+
+// indexed by ASTNode id
+HostArgvTemplate **host_argv_templates = 0;
+int host_argv_templates_capacity = 0;
+
+HostArgvTemplate *host_argv_template(ASTNode *node)
+{
+    if (node->id >= host_argv_templates_capacity)
     {
-        return pipe_write(thread->write_pipe, temp, strlen(temp));
+        int capacity = host_argv_templates_capacity ? host_argv_templates_capacity : 64;
+        while (capacity <= node->id) capacity *= 2;
+        host_argv_templates = realloc(host_argv_templates, capacity * sizeof(HostArgvTemplate*));
+        memset(&host_argv_templates[host_argv_templates_capacity], 0, (capacity - host_argv_templates_capacity) * sizeof(HostArgvTemplate*));
+        host_argv_templates_capacity = capacity;
     }
 
-    return 1;
+    HostArgvTemplate *template = host_argv_templates[node->id];
+    if (template) return template;
+
+    template = calloc(1, sizeof(HostArgvTemplate));
+    int n_arguments = 0;
+    int n_slots = 0;
+    for (ASTNode *argument = node->first_child; argument; argument = argument->next_sibling)
+    {
+        n_arguments += 1;
+        if (argument->type == NAME_NODE || argument->type == SUBSTITUTION_NODE) n_slots += 1;
+    }
+
+    template->arguments = calloc(n_arguments + 1, sizeof(char*));
+    template->slots = calloc(n_slots, sizeof(HostArgumentSlot));
+    for (ASTNode *argument = node->first_child; argument; argument = argument->next_sibling)
+    {
+        if (argument->type == NAME_NODE || argument->type == SUBSTITUTION_NODE)
+        {
+            HostArgumentSlot *slot = &template->slots[template->n_slots];
+            slot->node = argument;
+            slot->index = template->n_arguments;
+            template->n_slots += 1;
+            if (argument->type == SUBSTITUTION_NODE) template->n_substitutions += 1;
+        }
+        else
+        {
+            template->arguments[template->n_arguments] = argument->string;
+        }
+        template->n_arguments += 1;
+    }
+
+    // anything that starts a thread of its own is as far as the input goes
+    for (ASTNode *parent = node->parent; parent; parent = parent->parent)
+    {
+        enum ASTNodeType type = parent->type;
+        if (type == PIPE_NODE || type == TEE_NODE || type == ERROR_PIPE_NODE || type == REDIRECT_NODE || type == SUBSTITUTION_NODE || type == PARALLEL_NODE) break;
+        if (type == FOR_NODE)
+        {
+            template->inside_for_loop = 1;
+            break;
+        }
+    }
+
+    host_argv_templates[node->id] = template;
+    return template;
+}
+
+// substitutions take the strings from the thread's captures, in order, and host_argv_release frees them again
+void host_argv_fill(HostArgvTemplate *template, InterpreterThread *thread)
+{
+    int n_captures = 0;
+    for (int i = 0; i < template->n_slots; i++)
+    {
+        HostArgumentSlot *slot = &template->slots[i];
+        if (slot->node->type == SUBSTITUTION_NODE)
+        {
+            template->arguments[slot->index] = capture_to_string(thread->captures[n_captures]);
+            n_captures += 1;
+            continue;
+        }
+
+        // views change under the same Value, everything else is never modified once it's made
+        Value *value = lookup_symbol(slot->node);
+        if (value && value == slot->value && !value->is_view) continue;
+
+        char temp[32];
+        char *text = temp;
+        if (!value) temp[0] = 0;
+        else if (value->type == VALUE_TYPE_STRING) text = value->string_value;
+        else if (value->type == VALUE_TYPE_NUMBER) sprintf(temp, "%d", value->integer_value);
+        else sprintf(temp, value->boolean_value ? "true" : "false");
+
+        int length = strlen(text);
+        if (length + 1 > slot->capacity)
+        {
+            slot->capacity = length + 1 > 64 ? length + 1 : 64;
+            slot->buffer = realloc(slot->buffer, slot->capacity);
+        }
+        memcpy(slot->buffer, text, length + 1);
+        slot->value = value;
+        template->arguments[slot->index] = slot->buffer;
+    }
+}
+
+void host_argv_release(HostArgvTemplate *template)
+{
+    for (int i = 0; i < template->n_slots; i++)
+    {
+        HostArgumentSlot *slot = &template->slots[i];
+        if (slot->node->type == SUBSTITUTION_NODE) free(template->arguments[slot->index]);
+    }
 }
 
 int n_processes = 0;
-int execute_host_program(InterpreterThread *thread, char *program, char **arguments, int n_arguments)
+// to host_pipe_size if the kernel lets us, returns the size it ends up
+int host_pipe_resize(int fd)
+{
+    if (host_pipe_size > 0) fcntl(fd, F_SETPIPE_SZ, host_pipe_size);
+    int size = fcntl(fd, F_GETPIPE_SZ);
+    return size > 0 ? size : HOST_DEFAULT_PIPE_SIZE;
+}
+
+int execute_host_program(InterpreterThread *thread, char *program, char **arguments, int n_arguments, int with_input)
 {
     if (n_processes >= 10)
     {
@@ -307,6 +830,9 @@ int execute_host_program(InterpreterThread *thread, char *program, char **argume
     }
 
     arguments[n_arguments] = 0;
+    thread_detach_line(thread);
+
+    double spawn_started = stats_enabled ? stats_now() : 0;
 
     typedef struct { int read; int write; } POSIXFDPair;
     POSIXFDPair script_to_host;
@@ -330,23 +856,108 @@ int execute_host_program(InterpreterThread *thread, char *program, char **argume
         fcntl(script_to_host.write, F_SETFD, flags | FD_CLOEXEC);
     }
 
+    {
+        int flags = fcntl(script_to_host.write, F_GETFL);
+        fcntl(script_to_host.write, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    thread->host_pipe_capacity = host_pipe_resize(host_to_script.read);
+    if (with_input) host_pipe_resize(script_to_host.write);
+
+    // redirected streams are given to the process as they are, so it reads and writes the files itself -
+    // unless the input has been read ahead and can't be put back, in which case it's fed through as usual
+    int stdin_file = -1;
+    if (thread->error_pipe_in != -1)
+    {
+        stdin_file = thread->error_pipe_in;
+    }
+    else if (with_input && !thread->read_pipe && thread->stdin_file != -1 && input_buffer_unread(thread->input_file))
+    {
+        stdin_file = thread->stdin_file;
+    }
+    int stdout_file = thread->write_pipe || thread->capture ? -1 : thread->stdout_file;
+    int stderr_file = thread->error_pipe_out != -1 ? thread->error_pipe_out : thread->stderr_file;
+
+    POSIXFDPair host_errors_to_script = { -1, -1 };
+    if (thread->error_pipe && thread->error_pipe_out == -1)
+    {
+        pipe((int*) &host_errors_to_script);
+        fcntl(host_errors_to_script.read, F_SETFL, fcntl(host_errors_to_script.read, F_GETFL) | O_NONBLOCK);
+        fcntl(host_errors_to_script.read, F_SETFD, fcntl(host_errors_to_script.read, F_GETFD) | FD_CLOEXEC);
+        stderr_file = host_errors_to_script.write;
+    }
+
+    // anything still buffered would otherwise be written a second time by a child that fails to exec
+    fflush(stdout);
+    if (thread->output_file) fflush(thread->output_file);
+
     n_processes += 1;
     int pid = fork();
     if (pid == 0)
     {
-        dup2(host_to_script.write, STDOUT_FILENO);
-        dup2(script_to_host.read, STDIN_FILENO);
+        dup2(stdout_file != -1 ? stdout_file : host_to_script.write, STDOUT_FILENO);
+        dup2(stdin_file != -1 ? stdin_file : script_to_host.read, STDIN_FILENO);
+        if (stderr_file != -1) dup2(stderr_file, STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
 
         execvp(arguments[0], arguments);
         printf("ERROR: Could not start process \"%s\".\n", program);
-        exit(0);
+        fflush(stdout);
+        // _exit, so the child doesn't run our atexit handlers (--stats, --trace)
+        _exit(0);
     }
 
     close(host_to_script.write);
     close(script_to_host.read);
 
+    hostio_adopt(script_to_host.write);
+    hostio_adopt(host_to_script.read);
     thread->host_write = script_to_host.write;
     thread->host_read = host_to_script.read;
+    thread->host_input_finished = 0;
+    thread->host_output_finished = 0;
+
+    if (stdin_file != -1 || !with_input)
+    {
+        close(script_to_host.write);
+        thread->host_input_finished = 1;
+    }
+    if (stdout_file != -1)
+    {
+        close(host_to_script.read);
+        thread->host_output_finished = 1;
+    }
+
+    if (host_errors_to_script.read != -1) hostio_adopt(host_errors_to_script.read);
+    thread->host_errors = host_errors_to_script.read;
+    thread->host_errors_finished = host_errors_to_script.read == -1;
+    if (host_errors_to_script.write != -1) close(host_errors_to_script.write);
+
+    // the process has its own copies of these now, and the other end only sees EOF once ours are gone too
+    if (thread->error_pipe_in != -1) close(thread->error_pipe_in);
+    if (thread->error_pipe_out != -1) close(thread->error_pipe_out);
+    thread->error_pipe_in = -1;
+    thread->error_pipe_out = -1;
+
+    thread->host_pidfd = hostio_open_pidfd(pid);
+    if (thread->host_pidfd != -1) hostio_adopt(thread->host_pidfd);
+
+    thread->host_started = stats_enabled || trace_file ? stats_now() : 0;
+    if (trace_file) trace_host_launched(thread - thread_pool, program, pid);
+
+    n_host_processes_spawned += 1;
+    thread->host_stats_index = -1;
+    if (stats_enabled && n_host_process_stats < sizeof(host_process_stats) / sizeof(host_process_stats[0]))
+    {
+        HostProcessStats *stats = &host_process_stats[n_host_process_stats];
+        memset(stats, 0, sizeof(HostProcessStats));
+        stats->program = program;
+        stats->pid = pid;
+        stats->started = thread->host_started;
+        stats->spawn_latency = stats->started - spawn_started;
+        thread->host_stats_index = n_host_process_stats;
+        n_host_process_stats += 1;
+    }
 
     return pid;
 }
@@ -369,38 +980,704 @@ int is_truthy(Value *value)
     return 0;
 }
 
+const int REDIRECT_BUFFER_SIZE = 256 * 1024;
+
+// close-on-exec, so that only the processes it's meant for ever see it
+int open_redirect_file(char *path, enum RedirectKind kind)
+{
+    if (kind == REDIRECT_STDIN) return open(path, O_RDONLY | O_CLOEXEC);
+    if (kind == REDIRECT_STDOUT_APPEND || kind == REDIRECT_STDERR_APPEND) return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
 InterpreterThread *spawn_child_thread(InterpreterThread *parent, ASTNode *root)
 {
-    thread_pool[n_threads].root = root;
-    thread_pool[n_threads].current = root;
-    thread_pool[n_threads].n_pending_children = 0;
-    thread_pool[n_threads].finished = 0;
-    thread_pool[n_threads].parent = parent;
-    thread_pool[n_threads].context_stack_size = 0;
-    thread_pool[n_threads].returned_value = 0;
-    thread_pool[n_threads].awaiting_pid = 0;
-    thread_pool[n_threads].waiting_on_host_process = 0;
-    thread_pool[n_threads].host_read = STDIN_FILENO;
-    thread_pool[n_threads].host_write = STDOUT_FILENO;
+    InterpreterThread *child;
+    if (n_free_threads > 0)
+    {
+        n_free_threads -= 1;
+        child = &thread_pool[free_threads[n_free_threads]];
+        stats_retire_thread(&child->stats);
+    }
+    else if (n_threads < sizeof(thread_pool) / sizeof(thread_pool[0]))
+    {
+        child = &thread_pool[n_threads];
+        n_threads += 1;
+    }
+    else
+    {
+        printf("ERROR: Too many threads (%s:%d)\n", __FILE__, __LINE__);
+        exit(1);
+    }
+
+    child->root = root;
+    child->current = root;
+    child->n_pending_children = 0;
+    child->finished = 0;
+    child->is_background = 0;
+    child->n_background_jobs = 0;
+    child->waiting_for_jobs = 0;
+    child->timer = -1;
+    child->sleeping = 0;
+    child->timeout_timer = -1;
+    child->timed_out = 0;
+    child->parent = parent;
+    child->context_stack_size = 0;
+    child->returned_value = 0;
+    child->awaiting_pid = 0;
+    child->waiting_on_host_process = 0;
+    child->host_read = STDIN_FILENO;
+    child->host_write = STDOUT_FILENO;
+    child->host_pidfd = -1;
+    child->write_pipe = 0;
+    child->read_pipe = 0;
+    child->read_cursor = 0;
+    child->error_pipe = parent ? parent->error_pipe : 0;
+    child->error_pipe_in = -1;
+    child->error_pipe_out = -1;
+    child->stdin_file = parent ? parent->stdin_file : -1;
+    child->stdout_file = parent ? parent->stdout_file : -1;
+    child->stderr_file = parent ? parent->stderr_file : -1;
+    child->output_file = parent ? parent->output_file : 0;
+    child->input_file = parent ? parent->input_file : 0;
+    child->capture = parent ? parent->capture : 0;
+    child->captures = 0;
+    child->n_captures = 0;
+    child->parallel = 0;
+    child->n_pipeline_pipes = 0;
+    child->redirect_fd = -1;
+    child->redirect_output = 0;
+    child->redirect_input = 0;
+    child->print_offset = 0;
+    child->repeating_current_node = 0;
+    child->blocked_pipe = 0;
+    child->blocked_reason = BLOCK_REASON_NONE;
+    child->quantum = scheduler_quantum;
+    child->n_held_bytes = 0;
+    child->n_partial_line_bytes = 0;
+    child->line_view = 0;
+    child->loop_name = 0;
+    child->host_stats_index = -1;
+    memset(&child->stats, 0, sizeof(ThreadStats));
     
-    InterpreterThread *child = &thread_pool[n_threads];
     if (parent)
     {
         parent->n_pending_children += 1;
     }
-    n_threads += 1;
+    if (child->error_pipe)
+    {
+        child->error_pipe->n_writers += 1;
+    }
+
+    if (trace_file) trace_thread_spawned(child - thread_pool, parent ? parent - thread_pool : -1, root->type);
 
     return child;
 }
 
+// the block of a ${ ... } runs in a thread of its own, which the scheduler won't resume this one ahead of
+void thread_start_substitution(InterpreterThread *thread, ASTNode *substitution)
+{
+    CaptureBuffer *capture = calloc(1, sizeof(CaptureBuffer));
+    InterpreterThread *child = spawn_child_thread(thread, substitution->first_child);
+    child->capture = capture;
+
+    thread->captures = realloc(thread->captures, (thread->n_captures + 1) * sizeof(CaptureBuffer*));
+    thread->captures[thread->n_captures] = capture;
+    thread->n_captures += 1;
+}
+
+
+// used both when a thread runs off the end of its root node and when it's stopped because nobody is reading
+// its output any more
+// stderr is inherited like the redirections are, so anything that sends it somewhere else lets go of it first
+void thread_release_error_pipe(InterpreterThread *thread)
+{
+    if (thread->error_pipe)
+    {
+        thread->error_pipe->n_writers -= 1;
+        if (thread->error_pipe->n_writers == 0)
+        {
+            thread->error_pipe->closed = 1;
+        }
+    }
+    thread->error_pipe = 0;
+}
+
+void thread_finish(InterpreterThread *thread)
+{
+    if (thread->write_pipe)
+    {
+        thread->write_pipe->n_writers -= 1;
+        if (thread->write_pipe->n_writers == 0)
+        {
+            thread->write_pipe->closed = 1;
+        }
+    }
+
+    thread_release_error_pipe(thread);
+
+    if (thread->timer != -1) timer_cancel(thread->timer);
+    thread->timer = -1;
+    if (thread->timeout_timer != -1) timer_cancel(thread->timeout_timer);
+    thread->timeout_timer = -1;
+
+    // a process that never got started still mustn't keep the other end of its !| waiting
+    if (thread->error_pipe_in != -1) close(thread->error_pipe_in);
+    if (thread->error_pipe_out != -1) close(thread->error_pipe_out);
+
+    // a redirected statement borrows its parent's input, which the parent may well carry on reading
+    if (thread->read_pipe && !(thread->parent && thread->parent->read_pipe == thread->read_pipe))
+    {
+        pipe_close_reader(thread->read_pipe, thread->read_cursor);
+    }
+
+    thread->finished = 1;
+    if (trace_file) trace_thread_finished(thread - thread_pool);
+}
+
+/*
+parallel N [ordered] { ... }. The block is started N times, once and for all, each worker with an input
+and an output pipe of its own, and the thread that ran into it becomes the dispatcher. It hands its input out
+a line at a time and passes the workers' output on a line at a time, so lines from different workers can never
+get mixed up with each other.
+
+Unordered, each line goes to whichever worker has the least input waiting, and output is passed on as soon as
+it's there. Ordered, lines are dealt out strictly in turn and collected again in the same turn, which makes
+each worker's output pipe its slot in the reorder buffer - as long as every line in makes exactly one line
+out, like a map.
+*/
+struct ParallelStage
+{
+    int n_workers;
+    int ordered;
+    PipeBuffer *inputs[PARALLEL_MAX_WORKERS];
+    PipeBuffer *outputs[PARALLEL_MAX_WORKERS];
+
+    // the line being handed out, held in the dispatcher's input until all of it has gone to line_worker
+    char *line;
+    int line_length;
+    int line_worker;
+    int line_offset;
+    int next_input_worker;
+    int input_finished;
+
+    // likewise the line being passed on, held in next_output_worker's output, since peeking at it has already
+    // cut it off from the line after
+    char *output_line;
+    int output_n_bytes;
+    int next_output_worker;
+    char *output_copy;
+    int output_copy_capacity;
+    int output_partial; // of a line too long for the worker's output, see pipe_peek_line
+
+    // whatever comes after stopped reading, so the workers are only being waited on to stop as well
+    int abandoned;
+};
+
+typedef struct ParallelStage ParallelStage;
+
+ParallelStage *parallel_start(InterpreterThread *thread, ASTNode *node)
+{
+    ParallelStage *stage = calloc(1, sizeof(ParallelStage));
+    stage->n_workers = node->number & ~PARALLEL_ORDERED;
+    stage->ordered = (node->number & PARALLEL_ORDERED) != 0;
+
+    for (int i = 0; i < stage->n_workers; i++)
+    {
+        stage->inputs[i] = acquire_internal_pipe();
+        stage->inputs[i]->n_writers = 1;
+        stage->outputs[i] = acquire_internal_pipe();
+        stage->outputs[i]->n_writers = 1;
+
+        // workers are jobs, so that the dispatcher keeps running alongside them
+        InterpreterThread *worker = spawn_child_thread(thread, node->first_child);
+        worker->is_background = 1;
+        thread->n_background_jobs += 1;
+        worker->read_pipe = stage->inputs[i];
+        worker->write_pipe = stage->outputs[i];
+    }
+
+    return stage;
+}
+
+int parallel_pick_worker(ParallelStage *stage)
+{
+    if (stage->ordered) return stage->next_input_worker;
+
+    int best = 0;
+    for (int i = 1; i < stage->n_workers; i++)
+    {
+        if (stage->inputs[i]->reader_closed) continue;
+        if (stage->inputs[best]->reader_closed || pipe_occupancy(stage->inputs[i]) < pipe_occupancy(stage->inputs[best])) best = i;
+    }
+    return best;
+}
+
+void parallel_close_inputs(ParallelStage *stage)
+{
+    for (int i = 0; i < stage->n_workers; i++)
+    {
+        stage->inputs[i]->n_writers = 0;
+        stage->inputs[i]->closed = 1;
+    }
+}
+
+// how many bytes went in or out, or -1 once every worker is done and all their output has been passed on
+int parallel_step(InterpreterThread *thread, ParallelStage *stage)
+{
+    if (stage->abandoned)
+    {
+        // their pipes can't be handed out again while any of them might still write to them
+        for (int i = 0; i < stage->n_workers; i++)
+        {
+            if (!stage->outputs[i]->closed) return 0;
+        }
+        return -1;
+    }
+
+    int n_moved = 0;
+
+    while (!stage->input_finished)
+    {
+        if (!stage->line)
+        {
+            char *line;
+            int status = thread_next_line_view(thread, &line);
+            if (status == 0) break;
+            if (status == -1)
+            {
+                stage->input_finished = 1;
+                parallel_close_inputs(stage);
+                break;
+            }
+
+            stage->line = line;
+            stage->line_length = strlen(line);
+            stage->line_worker = parallel_pick_worker(stage);
+        }
+
+        // a worker that has stopped reading just doesn't get the line
+        PipeBuffer *input = stage->inputs[stage->line_worker];
+        if (!input->reader_closed && !pipe_write_line(input, stage->line, stage->line_length, &stage->line_offset)) break;
+
+        n_moved += stage->line_length + 1;
+        stage->line = 0;
+        stage->next_input_worker = (stage->line_worker + 1) % stage->n_workers;
+    }
+
+    // workers looked at in a row that had nothing to pass on
+    int n_idle = 0;
+    int n_done = 0;
+    while (n_idle < stage->n_workers)
+    {
+        int worker = stage->next_output_worker;
+        PipeBuffer *output = stage->outputs[worker];
+        if (!stage->output_line)
+        {
+            stage->output_n_bytes = pipe_peek_line(output, 0, &stage->output_line, &stage->output_copy, &stage->output_copy_capacity, &stage->output_partial);
+        }
+        int n_bytes = stage->output_n_bytes;
+        if (n_bytes == 0)
+        {
+            // in order, the next line can only ever come from this worker - as can the rest of a long one
+            if ((stage->ordered || stage->output_partial) && !output->closed) break;
+            stage->output_partial = 0;
+
+            n_idle += 1;
+            if (output->closed) n_done += 1;
+            stage->output_line = 0;
+            stage->next_output_worker = (worker + 1) % stage->n_workers;
+            continue;
+        }
+
+        Value value;
+        value.type = VALUE_TYPE_STRING;
+        value.string_value = stage->output_line;
+        value.is_view = 1;
+        int success = print(thread, &value);
+        if (success == -1)
+        {
+            // nobody wants the output any more, so the workers can stop too
+            stage->abandoned = 1;
+            parallel_close_inputs(stage);
+            for (int i = 0; i < stage->n_workers; i++) pipe_close_reader(stage->outputs[i], 0);
+            return 0;
+        }
+        if (!success) break;
+
+        pipe_consume(output, 0, n_bytes);
+        stage->output_line = 0;
+        n_moved += n_bytes;
+        n_idle = 0;
+        n_done = 0;
+        if (stage->ordered) stage->next_output_worker = (worker + 1) % stage->n_workers;
+    }
+
+    if (stage->input_finished && n_done == stage->n_workers) return -1;
+    return n_moved;
+}
+
+void parallel_finish(ParallelStage *stage)
+{
+    for (int i = 0; i < stage->n_workers; i++)
+    {
+        release_internal_pipe(stage->inputs[i]);
+        release_internal_pipe(stage->outputs[i]);
+    }
+    free(stage->output_copy);
+    free(stage);
+}
+
+/*
+What a pipeline looks like only depends on its links, so it's worked out once per PIPE_NODE: which of the
+pipeline's pipes each stage reads from and writes to, and how many readers each pipe has. Running it again,
+eg. on every pass of a loop, is then a matter of taking threads and pipes from the pools and filling in
+those fields.
+*/
+const int PIPELINE_TO_PARENT = -2; // wherever the pipeline's own output goes
+const int PIPELINE_MAX_PIPES = 32;
+
+struct PipelineStage
+{
+    ASTNode *root;
+
+    // indices into the pipeline's pipes, or -1
+    int read_pipe;
+    int read_cursor;
+    int write_pipe; // or PIPELINE_TO_PARENT
+    int error_pipe;
+
+    // for a !| between two host processes, which of the pipeline's kernel pipes its stderr goes into or its
+    // stdin comes from
+    int error_pipe_out;
+    int error_pipe_in;
+
+    int stderr_taken; // by a !|, so it doesn't go wherever the parent's goes
+};
+
+typedef struct PipelineStage PipelineStage;
+
+struct PipelineTemplate
+{
+    PipelineStage *stages;
+    int n_stages;
+    int *n_readers; // per pipe
+    int *n_writers;
+    int *dropped_readers; // per pipe, a bit for each reader that's closed as soon as it's set up
+    int *host_only; // per pipe, whether every stage at either end is a host process, so it can be made bigger
+    int n_pipes;
+    int n_kernel_pipes;
+};
+
+typedef struct PipelineTemplate PipelineTemplate;
+
+// indexed by ASTNode id
+PipelineTemplate **pipeline_templates = 0;
+int pipeline_templates_capacity = 0;
+
+int pipeline_add_pipe(PipelineTemplate *template)
+{
+    template->n_readers[template->n_pipes] = 1;
+    template->n_writers[template->n_pipes] = 1;
+    template->n_pipes += 1;
+    return template->n_pipes - 1;
+}
+
+PipelineTemplate *pipeline_template(ASTNode *node);
+
+/*
+{ a | b } | c runs as a | b | c, rather than with a thread for the block that does nothing but wait on a
+pipeline of its own - and so does d | { a | b } | c, as far as the threads go. A pipeline's first stage never
+reads what's piped into the block around it, so d's output went nowhere anyway, and the block's place as a
+reader is given up as soon as the pipeline starts rather than once the block is finished, which only means d
+finds out sooner. Only a block holding nothing but a pipeline is flattened, and only when its stderr isn't
+taken by a !|. The inner pipeline's pipes go after the outer one's, so nothing already there is renumbered.
+Returns how many stages have taken the block's place.
+*/
+int pipeline_flatten_stage(PipelineTemplate *template, int index)
+{
+    PipelineStage *outer = &template->stages[index];
+    ASTNode *block = outer->root;
+    if (block->type != CODEBLOCK_NODE || !block->first_child || block->first_child->next_sibling) return 1;
+
+    ASTNode *statement = block->first_child;
+    if (statement->type != PIPE_NODE && statement->type != TEE_NODE && statement->type != ERROR_PIPE_NODE) return 1;
+    if (outer->stderr_taken) return 1;
+
+    PipelineTemplate *inner = pipeline_template(statement);
+    int n_pipes = template->n_pipes + inner->n_pipes;
+    int n_kernel_pipes = template->n_kernel_pipes + inner->n_kernel_pipes;
+    if (n_pipes > PIPELINE_MAX_PIPES || n_kernel_pipes > PIPELINE_MAX_PIPES) return 1;
+
+    // the inner pipeline's output goes wherever the block's went
+    int n_output_writers = 0;
+    for (int i = 0; i < inner->n_stages; i++) n_output_writers += inner->stages[i].write_pipe == PIPELINE_TO_PARENT;
+    if (n_output_writers == 0) return 1;
+
+    int n_stages = template->n_stages + inner->n_stages - 1;
+    PipelineStage *stages = calloc(n_stages, sizeof(PipelineStage));
+    int *n_readers = calloc(n_pipes, sizeof(int));
+    int *n_writers = calloc(n_pipes, sizeof(int));
+    int *dropped_readers = calloc(n_pipes, sizeof(int));
+    memcpy(n_readers, template->n_readers, template->n_pipes * sizeof(int));
+    memcpy(n_writers, template->n_writers, template->n_pipes * sizeof(int));
+    memcpy(dropped_readers, template->dropped_readers, template->n_pipes * sizeof(int));
+    memcpy(&n_readers[template->n_pipes], inner->n_readers, inner->n_pipes * sizeof(int));
+    memcpy(&n_writers[template->n_pipes], inner->n_writers, inner->n_pipes * sizeof(int));
+    memcpy(&dropped_readers[template->n_pipes], inner->dropped_readers, inner->n_pipes * sizeof(int));
+
+    int output = outer->write_pipe;
+    if (output >= 0) n_writers[output] = n_output_writers;
+    if (outer->read_pipe >= 0) dropped_readers[outer->read_pipe] |= 1 << outer->read_cursor;
+
+    memcpy(stages, template->stages, index * sizeof(PipelineStage));
+    for (int i = 0; i < inner->n_stages; i++)
+    {
+        PipelineStage *stage = &stages[index + i];
+        *stage = inner->stages[i];
+        if (stage->read_pipe >= 0) stage->read_pipe += template->n_pipes;
+        if (stage->write_pipe >= 0) stage->write_pipe += template->n_pipes;
+        if (stage->write_pipe == PIPELINE_TO_PARENT) stage->write_pipe = output;
+        if (stage->error_pipe >= 0) stage->error_pipe += template->n_pipes;
+        if (stage->error_pipe_out >= 0) stage->error_pipe_out += template->n_kernel_pipes;
+        if (stage->error_pipe_in >= 0) stage->error_pipe_in += template->n_kernel_pipes;
+    }
+    memcpy(&stages[index + inner->n_stages], &template->stages[index + 1], (template->n_stages - index - 1) * sizeof(PipelineStage));
+
+    free(template->stages);
+    free(template->n_readers);
+    free(template->n_writers);
+    free(template->dropped_readers);
+    template->stages = stages;
+    template->n_stages = n_stages;
+    template->n_readers = n_readers;
+    template->n_writers = n_writers;
+    template->dropped_readers = dropped_readers;
+    template->n_pipes = n_pipes;
+    template->n_kernel_pipes = n_kernel_pipes;
+    return inner->n_stages;
+}
+
+// only once the stages are final, since flattening brings in more pipes
+void pipeline_find_host_only_pipes(PipelineTemplate *template)
+{
+    template->host_only = malloc(template->n_pipes * sizeof(int));
+    for (int i = 0; i < template->n_pipes; i++) template->host_only[i] = 1;
+
+    for (int i = 0; i < template->n_stages; i++)
+    {
+        PipelineStage *stage = &template->stages[i];
+        if (stage->root->type == HOST_NODE) continue;
+        if (stage->read_pipe >= 0) template->host_only[stage->read_pipe] = 0;
+        if (stage->write_pipe >= 0) template->host_only[stage->write_pipe] = 0;
+        if (stage->error_pipe >= 0) template->host_only[stage->error_pipe] = 0;
+    }
+}
+
+// a | b feeds a into b and carries on from b, whereas a &| b feeds a into b as well as into whatever comes
+// next - b's own output goes wherever the whole pipeline's output goes. a !| b feeds a's stderr into b and
+// carries on from b, and a's stdout goes to the pipeline's output
+PipelineTemplate *pipeline_template(ASTNode *node)
+{
+    if (node->id >= pipeline_templates_capacity)
+    {
+        int capacity = pipeline_templates_capacity ? pipeline_templates_capacity : 64;
+        while (capacity <= node->id) capacity *= 2;
+        pipeline_templates = realloc(pipeline_templates, capacity * sizeof(PipelineTemplate*));
+        memset(&pipeline_templates[pipeline_templates_capacity], 0, (capacity - pipeline_templates_capacity) * sizeof(PipelineTemplate*));
+        pipeline_templates_capacity = capacity;
+    }
+
+    PipelineTemplate *template = pipeline_templates[node->id];
+    if (template) return template;
+
+    template = calloc(1, sizeof(PipelineTemplate));
+    int n_stages = 1;
+    for (ASTNode *link = node; link; )
+    {
+        ASTNode *chain = link->first_child->next_sibling;
+        n_stages += 1;
+        link = chain->type == PIPE_NODE || chain->type == TEE_NODE || chain->type == ERROR_PIPE_NODE ? chain : 0;
+    }
+    if (n_stages - 1 > PIPELINE_MAX_PIPES)
+    {
+        printf("ERROR: Too many stages in one pipeline (%s:%d)\n", __FILE__, __LINE__);
+        exit(1);
+    }
+
+    template->stages = calloc(n_stages, sizeof(PipelineStage));
+    template->n_readers = calloc(n_stages, sizeof(int));
+    template->n_writers = calloc(n_stages, sizeof(int));
+    template->dropped_readers = calloc(n_stages, sizeof(int));
+    for (int i = 0; i < n_stages; i++)
+    {
+        PipelineStage *stage = &template->stages[i];
+        stage->read_pipe = -1;
+        stage->write_pipe = -1;
+        stage->error_pipe = -1;
+        stage->error_pipe_out = -1;
+        stage->error_pipe_in = -1;
+    }
+
+    template->stages[0].root = node->first_child;
+    template->n_stages = 1;
+    int left = 0;
+    ASTNode *link = node;
+    while (link)
+    {
+        ASTNode *chain = link->first_child->next_sibling;
+        int chain_continues = chain->type == PIPE_NODE || chain->type == TEE_NODE || chain->type == ERROR_PIPE_NODE;
+        int right = template->n_stages;
+        template->n_stages += 1;
+
+        PipelineStage *left_stage = &template->stages[left];
+        PipelineStage *right_stage = &template->stages[right];
+        right_stage->root = chain_continues ? chain->first_child : chain;
+
+        if (link->type == ERROR_PIPE_NODE)
+        {
+            left_stage->stderr_taken = 1;
+            if (left_stage->root->type == HOST_NODE && right_stage->root->type == HOST_NODE)
+            {
+                // two processes can just share a kernel pipe, and then the data never comes through here
+                left_stage->error_pipe_out = template->n_kernel_pipes;
+                right_stage->error_pipe_in = template->n_kernel_pipes;
+                template->n_kernel_pipes += 1;
+            }
+            else
+            {
+                left_stage->error_pipe = pipeline_add_pipe(template);
+                right_stage->read_pipe = left_stage->error_pipe;
+            }
+
+            if (left_stage->write_pipe == -1) left_stage->write_pipe = PIPELINE_TO_PARENT;
+        }
+        else if (left_stage->write_pipe == -1)
+        {
+            left_stage->write_pipe = pipeline_add_pipe(template);
+            right_stage->read_pipe = left_stage->write_pipe;
+        }
+        else
+        {
+            // a tee already gave it a pipe, so this is just one more reader of it
+            if (template->n_readers[left_stage->write_pipe] == PIPE_MAX_READERS)
+            {
+                printf("ERROR: Too many readers on one tee (%s:%d)\n", __FILE__, __LINE__);
+                exit(1);
+            }
+            right_stage->read_pipe = left_stage->write_pipe;
+            right_stage->read_cursor = template->n_readers[left_stage->write_pipe];
+            template->n_readers[left_stage->write_pipe] += 1;
+        }
+
+        if (link->type != TEE_NODE) left = right;
+        if (link->type == TEE_NODE || !chain_continues) right_stage->write_pipe = PIPELINE_TO_PARENT;
+
+        link = chain_continues ? chain : 0;
+    }
+
+    for (int i = 0; i < template->n_stages; ) i += pipeline_flatten_stage(template, i);
+    pipeline_find_host_only_pipes(template);
+
+    pipeline_templates[node->id] = template;
+    return template;
+}
+
+void pipeline_start(InterpreterThread *thread, PipelineTemplate *template)
+{
+    PipeBuffer **pipes = thread->pipeline_pipes;
+    for (int i = 0; i < template->n_pipes; i++)
+    {
+        pipes[i] = acquire_internal_pipe();
+        if (template->host_only[i] && host_pipe_size > PIPE_BUFFER_SIZE) pipe_set_capacity(pipes[i], host_pipe_size);
+        pipes[i]->n_writers = template->n_writers[i];
+        for (int j = 1; j < template->n_readers[i]; j++) pipe_add_reader(pipes[i]);
+        for (int j = 0; j < template->n_readers[i]; j++)
+        {
+            if (template->dropped_readers[i] & (1 << j)) pipe_close_reader(pipes[i], j);
+        }
+    }
+    thread->n_pipeline_pipes = template->n_pipes;
+
+    // the reading ends of the kernel pipes, between making them for one stage and giving them to a later one
+    int kernel_pipe_reads[PIPELINE_MAX_PIPES];
+
+    for (int i = 0; i < template->n_stages; i++)
+    {
+        PipelineStage *stage = &template->stages[i];
+        InterpreterThread *child = spawn_child_thread(thread, stage->root);
+
+        if (stage->stderr_taken) thread_release_error_pipe(child);
+        if (stage->error_pipe != -1) child->error_pipe = pipes[stage->error_pipe];
+        if (stage->error_pipe_out != -1)
+        {
+            int fds[2];
+            pipe(fds);
+            fcntl(fds[0], F_SETFD, fcntl(fds[0], F_GETFD) | FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, fcntl(fds[1], F_GETFD) | FD_CLOEXEC);
+            child->error_pipe_out = fds[1];
+            kernel_pipe_reads[stage->error_pipe_out] = fds[0];
+        }
+        if (stage->error_pipe_in != -1) child->error_pipe_in = kernel_pipe_reads[stage->error_pipe_in];
+
+        if (stage->read_pipe != -1)
+        {
+            child->read_pipe = pipes[stage->read_pipe];
+            child->read_cursor = stage->read_cursor;
+        }
+
+        if (stage->write_pipe == PIPELINE_TO_PARENT)
+        {
+            if (thread->write_pipe)
+            {
+                child->write_pipe = thread->write_pipe;
+                thread->write_pipe->n_writers += 1;
+            }
+        }
+        else if (stage->write_pipe != -1)
+        {
+            child->write_pipe = pipes[stage->write_pipe];
+        }
+    }
+}
+
+void thread_end_timeout(InterpreterThread *thread)
+{
+    if (thread->timeout_timer != -1) timer_cancel(thread->timeout_timer);
+    thread->timeout_timer = -1;
+    thread->timed_out = 0;
+}
+
+// once every stage is finished, which is as soon as the thread that started the pipeline is resumed again
+void thread_release_pipeline(InterpreterThread *thread)
+{
+    for (int i = 0; i < thread->n_pipeline_pipes; i++) release_internal_pipe(thread->pipeline_pipes[i]);
+    thread->n_pipeline_pipes = 0;
+}
+
 void resume_execution(InterpreterThread *thread)
 {
+    int n_executed = 0;
+    enum BlockReason block_reason = BLOCK_REASON_NONE;
+    int yielded_at_high_watermark = 0;
+    int preempted = 0;
+    double resume_started = trace_file ? stats_now() : 0;
     int done = 0;
     ASTNode *current_node = thread->current;
+    enum ASTNodeType resumed_at = current_node->type;
+    int repeating = thread->repeating_current_node;
+    if (thread->loop_name) set_symbol(thread->loop_name->symbol, thread->loop_value);
+    if (thread->n_pipeline_pipes) thread_release_pipeline(thread);
     while (!done)
     {
         ASTNode *down = 0;
 
+        if (profile_enabled)
+        {
+            profile_current_node = current_node;
+            if (!thread->returned_value && !repeating) profile_count_execution(current_node);
+        }
+
         int current_context_is_mine = thread->returned_value != 0;
         if (!thread->returned_value)
         {
@@ -415,6 +1692,15 @@ void resume_execution(InterpreterThread *thread)
                 n_required_values = 1;
                 break;
                 
+                case TIMEOUT_NODE:
+                n_required_values = 1;
+                break;
+
+                case SLEEP_NODE:
+                // only on the way in - once it's asleep, it only comes back here to wake up
+                n_required_values = !thread->sleeping;
+                break;
+
                 case ADD_NODE:
                 case MULTIPLY_NODE:
                 case LESSTHAN_NODE:
@@ -482,12 +1768,27 @@ void resume_execution(InterpreterThread *thread)
             {
                 Value *value = context->values[0];
                 int success = print(thread, value);
-                if (!success)
+                if (success == -1)
+                {
+                    // the equivalent of dying of SIGPIPE - and since this thread stops reading its own input,
+                    // whatever is writing to it will stop the next time it prints too
+                    thread_finish(thread);
+                    down = current_node;
+                    done = 1;
+                }
+                else if (!success)
                 {
                     // pipe is full - we have to retry later
                     down = current_node;
                     do_pop_context = 1;
                     done = 1;
+                    block_reason = BLOCK_REASON_PIPE_FULL;
+                }
+                else if (thread->write_pipe && pipe_occupancy(thread->write_pipe) >= thread->write_pipe->high_watermark)
+                {
+                    // give the reader a whole batch to work through before coming back
+                    done = 1;
+                    yielded_at_high_watermark = 1;
                 }
             }
             else if (current_node->type == EXIT_NODE)
@@ -497,30 +1798,53 @@ void resume_execution(InterpreterThread *thread)
             }
             else if (current_node->type == SET_NODE)
             {
-                char *name = current_node->first_child->next_sibling->name;
+                int symbol = current_node->first_child->next_sibling->symbol;
                 Value *value = context->values[0];
-                set_symbol(name, value);
+                if (value->is_view)
+                {
+                    // the line is about to outlive its loop iteration, so it needs a copy of its own
+                    Value *copy = alloc_value(VALUE_TYPE_STRING);
+                    copy->string_value = save_string_to_heap(value->string_value);
+                    value = copy;
+                }
+                set_symbol(symbol, value);
             }
             else if (current_node->type == HOST_NODE)
             {
-                if (!thread->waiting_on_host_process)
+                HostArgvTemplate *template = host_argv_template(current_node);
+
+                // substitutions in the arguments all run at the same time, before the process is started
+                int n_substitutions = 0;
+                if (!thread->waiting_on_host_process && thread->n_captures == 0)
                 {
-                    char *program = current_node->first_child->string;
-                    char *arguments[64];
-                    arguments[0] = program;
-                    int n_arguments = 1;
-                    ASTNode *argument = current_node->first_child->next_sibling;
-                    while (argument)
+                    for (int i = 0; i < template->n_slots; i++)
                     {
-                        arguments[n_arguments] = argument->string;
-                        n_arguments += 1;
-                        argument = argument->next_sibling;
-                    }                    
-                    int pid = execute_host_program(thread, program, arguments, n_arguments);
+                        if (template->slots[i].node->type != SUBSTITUTION_NODE) continue;
+                        thread_start_substitution(thread, template->slots[i].node);
+                        n_substitutions += 1;
+                    }
+                }
+
+                if (n_substitutions > 0)
+                {
+                    down = current_node;
+                    done = 1;
+                }
+                else if (!thread->waiting_on_host_process)
+                {
+                    char *program = current_node->first_child->string;
+                    host_argv_fill(template, thread);
+                    int pid = execute_host_program(thread, program, template->arguments, template->n_arguments, !template->inside_for_loop);
+
+                    // the process has its own copy of the arguments now
+                    host_argv_release(template);
+                    thread->n_captures = 0;
+
                     if (pid > 0)
                     {
                         thread->awaiting_pid = pid;
                         thread->waiting_on_host_process = 1;
+                        if (thread->timed_out) kill(pid, SIGTERM);
                     }
                     else
                     {
@@ -532,35 +1856,69 @@ void resume_execution(InterpreterThread *thread)
                 else
                 {
                     int may_continue = 1;
-                    int may_read_data = 1;
-                    if (thread->write_pipe)
+                    if (thread->write_pipe && thread->write_pipe->reader_closed && !thread->host_output_finished)
+                    {
+                        // nobody wants the process's output any more, so stop collecting it - it gets
+                        // SIGPIPE the next time it writes
+                        hostio_close(thread->host_read);
+                        thread->host_output_finished = 1;
+                    }
+
+                    int n_moved = thread_write_to_host(thread);
+
+                    if (!thread->host_output_finished)
+                    {
+                        // try to read data from process
+                        n_moved += thread_read_from_host(thread);
+
+                        // the process isn't done with until we've seen the end of its output, even if it has exited
+                        if (!thread->host_output_finished) may_continue = 0;
+                    }
+
+                    if (!thread->host_errors_finished)
                     {
-                        // try to send data
-                        pipe_try_to_flush_unsent(thread->write_pipe);
-                        if (thread->write_pipe->n_unsent_bytes > 0)
+                        PipeBuffer *pipe = thread->error_pipe;
+                        if (pipe->reader_closed)
                         {
-                            may_read_data = 0;
-                            may_continue = 0;
+                            hostio_close(thread->host_errors);
+                            thread->host_errors_finished = 1;
+                        }
+                        else
+                        {
+                            n_moved += thread_read_errors_from_host(thread);
+                            if (!thread->host_errors_finished) may_continue = 0;
                         }
                     }
 
-                    thread_write_to_host(thread);
-
                     if (thread->awaiting_pid > 0)
                     {
-                        if (may_read_data)
+                        int exit_code;
+                        struct rusage usage;
+                        int result = 0;
+                        if (thread->host_pidfd == -1 || hostio_is_ready(thread->host_pidfd))
                         {
-                            // try to read data from process
-                            thread_read_from_host(thread);
+                            result = wait4(thread->awaiting_pid, &exit_code, WNOHANG, &usage);
+                            if (result == 0 && thread->host_pidfd != -1) hostio_would_block(thread->host_pidfd, POLLIN);
                         }
 
-                        int exit_code;
-                        int result = waitpid(thread->awaiting_pid, &exit_code, WNOHANG);                    
                         if (result > 0)
                         {
                             // process is done
                             thread->awaiting_pid = 0;
                             n_processes -= 1;
+                            if (thread->host_pidfd != -1) hostio_close(thread->host_pidfd);
+                            thread->host_pidfd = -1;
+
+                            if (trace_file) trace_host_exited(thread - thread_pool, current_node->first_child->string, result, thread->host_started, WIFEXITED(exit_code) ? WEXITSTATUS(exit_code) : -1);
+
+                            if (thread->host_stats_index != -1)
+                            {
+                                HostProcessStats *stats = &host_process_stats[thread->host_stats_index];
+                                stats->wall_time = stats_now() - stats->started;
+                                stats->usage = usage;
+                                stats->exit_status = exit_code;
+                                stats->finished = 1;
+                            }
                         }
                         else
                         {
@@ -575,6 +1933,7 @@ void resume_execution(InterpreterThread *thread)
                     else
                     {
                         down = current_node;
+                        if (n_moved == 0) block_reason = BLOCK_REASON_HOST;
                     }
 
                     /*
@@ -609,37 +1968,197 @@ void resume_execution(InterpreterThread *thread)
                     down = body;
                 }
             }
-            else if (current_node->type == PIPE_NODE)
+            else if (current_node->type == FOR_NODE)
             {
-                ASTNode *chain = current_node->first_child->next_sibling;
-                InterpreterThread *left_thread = spawn_child_thread(thread, current_node->first_child);
-                while (chain->type == PIPE_NODE)
+                ASTNode *name = current_node->first_child;
+                char *line;
+                int status = thread_next_line_view(thread, &line);
+                if (status == 1)
+                {
+                    // one Value per thread, pointed at each line in turn
+                    if (!thread->line_view)
+                    {
+                        thread->line_view = alloc_value(VALUE_TYPE_STRING);
+                        thread->line_view->is_view = 1;
+                    }
+                    thread->line_view->string_value = line;
+                    set_symbol(name->symbol, thread->line_view);
+                    if (name->symbol >= 0) thread->loop_name = name;
+                    down = name->next_sibling;
+                }
+                else if (status == 0)
+                {
+                    // not enough data - we need to try again later
+                    down = current_node;
+                    done = 1;
+                    block_reason = BLOCK_REASON_PIPE_EMPTY;
+                }
+                else
                 {
-                    ASTNode *node = chain->first_child;
-                    InterpreterThread *right_thread = spawn_child_thread(thread, node);
-                    
-                    PipeBuffer *pipe = acquire_internal_pipe();
-                    left_thread->write_pipe = pipe;
-                    right_thread->read_pipe = pipe;
-                    pipe->n_writers = 1;
-                    
-                    left_thread = right_thread;
-                    chain = chain->first_child->next_sibling;
+                    // the variable mustn't be left pointing at a line that's gone
+                    Value *value = alloc_value(VALUE_TYPE_BOOLEAN);
+                    value->boolean_value = 0;
+                    set_symbol(name->symbol, value);
+                    thread->loop_name = 0;
                 }
+            }
+            else if (current_node->type == PIPE_NODE || current_node->type == TEE_NODE || current_node->type == ERROR_PIPE_NODE)
+            {
+                pipeline_start(thread, pipeline_template(current_node));
+                done = 1;
+            }
+            else if (current_node->type == REDIRECT_NODE)
+            {
+                if (!repeating)
+                {
+                    // the statement gets a thread of its own, so the redirection lasts exactly as long as it
+                    // does - this one waits here until it's done and then closes the file
+                    ASTNode *file = current_node->first_child->next_sibling;
+                    int fd = open_redirect_file(file->string, current_node->number);
+                    if (fd == -1)
+                    {
+                        printf("ERROR: Could not open \"%s\" (%s)\n", file->string, strerror(errno));
+                    }
+                    else
+                    {
+                        InterpreterThread *child = spawn_child_thread(thread, current_node->first_child);
+                        thread->redirect_fd = fd;
+                        if (current_node->number == REDIRECT_STDIN)
+                        {
+                            thread->redirect_input = calloc(1, sizeof(InputBuffer));
+                            thread->redirect_input->fd = fd;
+                            child->stdin_file = fd;
+                            child->input_file = thread->redirect_input;
+                        }
+                        else if (thread->read_pipe)
+                        {
+                            child->read_pipe = thread->read_pipe;
+                            child->read_cursor = thread->read_cursor;
+                        }
+
+                        if (current_node->number == REDIRECT_STDOUT || current_node->number == REDIRECT_STDOUT_APPEND)
+                        {
+                            thread->redirect_output = fdopen(fd, "w");
+                            setvbuf(thread->redirect_output, 0, _IOFBF, REDIRECT_BUFFER_SIZE);
+                            child->stdout_file = fd;
+                            child->output_file = thread->redirect_output;
+                            child->capture = 0;
+                        }
+                        else if (thread->write_pipe)
+                        {
+                            child->write_pipe = thread->write_pipe;
+                            thread->write_pipe->n_writers += 1;
+                        }
 
-                InterpreterThread *right_thread = spawn_child_thread(thread, chain);
-                PipeBuffer *pipe = acquire_internal_pipe();
-                left_thread->write_pipe = pipe;
-                right_thread->read_pipe = pipe;
-                pipe->n_writers = 1;
+                        if (current_node->number == REDIRECT_STDERR || current_node->number == REDIRECT_STDERR_APPEND)
+                        {
+                            thread_release_error_pipe(child);
+                            child->stderr_file = fd;
+                        }
 
+                        down = current_node;
+                        done = 1;
+                    }
+                }
+                else
+                {
+                    if (thread->redirect_output) fclose(thread->redirect_output);
+                    else close(thread->redirect_fd);
+                    if (thread->redirect_input)
+                    {
+                        free(thread->redirect_input->data);
+                        free(thread->redirect_input);
+                    }
+                    thread->redirect_fd = -1;
+                    thread->redirect_output = 0;
+                    thread->redirect_input = 0;
+                }
+            }
+            else if (current_node->type == SUBSTITUTION_NODE)
+            {
+                if (thread->n_captures == 0)
+                {
+                    // come back once the block is done
+                    thread_start_substitution(thread, current_node);
+                    down = current_node;
+                    done = 1;
+                }
+                else
+                {
+                    thread->returned_value = alloc_value(VALUE_TYPE_STRING);
+                    thread->returned_value->string_value = capture_to_string(thread->captures[0]);
+                    thread->n_captures = 0;
+                }
+            }
+            else if (current_node->type == BACKGROUND_NODE)
+            {
+                // same as a statement on its own, except that this thread doesn't wait for it
+                InterpreterThread *job = spawn_child_thread(thread, current_node->first_child);
+                job->is_background = 1;
+                thread->n_background_jobs += 1;
                 if (thread->write_pipe)
                 {
-                    right_thread->write_pipe = thread->write_pipe;
+                    job->write_pipe = thread->write_pipe;
                     thread->write_pipe->n_writers += 1;
                 }
-                
-                done = 1;
+            }
+            else if (current_node->type == PARALLEL_NODE)
+            {
+                if (!thread->parallel) thread->parallel = parallel_start(thread, current_node);
+
+                int n_moved = parallel_step(thread, thread->parallel);
+                if (n_moved == -1)
+                {
+                    parallel_finish(thread->parallel);
+                    thread->parallel = 0;
+                }
+                else
+                {
+                    down = current_node;
+                    done = 1;
+                    // waiting on the workers, which is as good as waiting on a process
+                    if (n_moved == 0) block_reason = BLOCK_REASON_HOST;
+                }
+            }
+            else if (current_node->type == SLEEP_NODE)
+            {
+                if (!thread->sleeping && !thread->timed_out)
+                {
+                    Value *value = context->values[0];
+                    thread->timer = timer_start(thread - thread_pool, TIMER_WAKE, (long) value->integer_value * current_node->number);
+                    thread->sleeping = 1;
+                    down = current_node;
+                    done = 1;
+                }
+                else
+                {
+                    thread->sleeping = 0;
+                }
+            }
+            else if (current_node->type == TIMEOUT_NODE)
+            {
+                // the statement is the only thing this thread does until it's over, so the timer is cancelled as
+                // soon as it leaves the statement again - see thread_end_timeout. When it goes off, it stops the process
+                // or sleep this thread is waiting on and keeps anything else from starting, but pipeline stages are
+                // threads of their own, and a loop that never waits on anything runs on regardless. One inside
+                // another cuts the outer one short
+                if (thread->timeout_timer != -1) timer_cancel(thread->timeout_timer);
+                Value *value = context->values[0];
+                thread->timeout_timer = timer_start(thread - thread_pool, TIMER_KILL, (long) value->integer_value * current_node->number);
+                down = current_node->first_child->next_sibling;
+            }
+            else if (current_node->type == WAIT_NODE)
+            {
+                if (!thread->waiting_for_jobs && thread->n_background_jobs > 0)
+                {
+                    thread->waiting_for_jobs = 1;
+                    down = current_node;
+                    done = 1;
+                }
+                else
+                {
+                    thread->waiting_for_jobs = 0;
+                }
             }
             else if (current_node->type == NUMBER_NODE)
             {
@@ -653,7 +2172,7 @@ void resume_execution(InterpreterThread *thread)
             }
             else if (current_node->type == NAME_NODE)
             {
-                thread->returned_value = lookup_symbol(current_node->name);
+                thread->returned_value = lookup_symbol(current_node);
             }
             else if (current_node->type == FUNCTION_CALL_NODE)
             {
@@ -670,6 +2189,7 @@ void resume_execution(InterpreterThread *thread)
                         down = current_node;
                         do_pop_context = 0;
                         done = 1;
+                        block_reason = BLOCK_REASON_PIPE_EMPTY;
                     }
                 }
                 else
@@ -704,17 +2224,25 @@ void resume_execution(InterpreterThread *thread)
                 }
                 else if (left->type == VALUE_TYPE_STRING && right->type == VALUE_TYPE_NUMBER)
                 {
-                    char buffer[256];
+                    int length = strlen(left->string_value) + 16;
+                    char *buffer = malloc(length);
+                    allocation_stats.n_strings += 1;
+                    allocation_stats.string_bytes += length;
+                    if (profile_enabled) profile_count_allocation(length);
                     sprintf(buffer, "%s%d",left->string_value, right->integer_value);
                     result = alloc_value(VALUE_TYPE_STRING);
-                    result->string_value = save_string_to_heap(buffer);
+                    result->string_value = buffer;
                 }
                 else if (left->type == VALUE_TYPE_STRING && right->type == VALUE_TYPE_STRING)
                 {
-                    char buffer[256];
+                    int length = strlen(left->string_value) + strlen(right->string_value) + 1;
+                    char *buffer = malloc(length);
+                    allocation_stats.n_strings += 1;
+                    allocation_stats.string_bytes += length;
+                    if (profile_enabled) profile_count_allocation(length);
                     sprintf(buffer, "%s%s",left->string_value, right->string_value);
                     result = alloc_value(VALUE_TYPE_STRING);
-                    result->string_value = save_string_to_heap(buffer);
+                    result->string_value = buffer;
                 }
 
                 if (!result)
@@ -791,6 +2319,8 @@ void resume_execution(InterpreterThread *thread)
             thread->context_stack_size -= 1;
         }
 
+        if (block_reason == BLOCK_REASON_NONE) n_executed += 1;
+
         ASTNode *next = 0;
         if (down)
         {
@@ -807,22 +2337,7 @@ void resume_execution(InterpreterThread *thread)
         {
             if (node == thread->root)
             {
-
-                if (thread->write_pipe)
-                {
-                    thread->write_pipe->n_writers -= 1;
-                    if (thread->write_pipe->n_writers == 0)
-                    {
-                        thread->write_pipe->closed = 1;
-                    }
-                }
-
-                if (thread->read_pipe)
-                {
-                    thread->read_pipe->closed = 1;                
-                }
-
-                thread->finished = 1;
+                thread_finish(thread);
                 done = 1;
                 break;
             }
@@ -833,30 +2348,160 @@ void resume_execution(InterpreterThread *thread)
             else
             {
                 ASTNode *parent = node->parent;
-                if (parent->type == WHILE_NODE)
+                if (parent->type == WHILE_NODE || parent->type == FOR_NODE)
                 {
                     next = parent;
+
+                    // every long-running thread passes through here, so this is where it gets preempted
+                    if (thread->quantum && n_executed >= thread->quantum)
+                    {
+                        done = 1;
+                        preempted = 1;
+                    }
                 }
                 else
                 {
+                    // the statement is over, whether or not it ever got as far as starting anything
+                    if (parent->type == TIMEOUT_NODE) thread_end_timeout(thread);
                     node = parent;
                 }
             }
         }
 
+        repeating = next == current_node;
         current_node = next;
     }
 
     thread->current = current_node;
+    thread->repeating_current_node = repeating;
+    if (profile_enabled) profile_current_node = 0;
+
+    stats_count_resume(&thread->stats, n_executed > 0, block_reason);
+    if (n_executed > 0) n_productive_resumes += 1;
+
+    if (preempted)
+    {
+        thread->stats.n_preemptions += 1;
+        if (thread->quantum < scheduler_quantum * SCHEDULER_MAX_QUANTUM_SCALE) thread->quantum *= 2;
+    }
+    else
+    {
+        thread->quantum = scheduler_quantum;
+    }
+
+    if (thread->loop_name) thread->loop_value = symbol_table[thread->loop_name->symbol].value;
+
+    thread->blocked_pipe = 0;
+    thread->blocked_reason = BLOCK_REASON_NONE;
+    if (block_reason == BLOCK_REASON_PIPE_FULL || yielded_at_high_watermark)
+    {
+        thread->blocked_pipe = thread->write_pipe;
+        thread->blocked_reason = BLOCK_REASON_PIPE_FULL;
+    }
+    else if (block_reason == BLOCK_REASON_PIPE_EMPTY)
+    {
+        thread->blocked_pipe = thread->read_pipe;
+        thread->blocked_reason = BLOCK_REASON_PIPE_EMPTY;
+        thread->blocked_pipe_bytes_written = thread->read_pipe->stats.n_bytes_written;
+    }
+
+    if (trace_file)
+    {
+        int read_pipe_id = thread->read_pipe ? thread->read_pipe - pipe_buffers : -1;
+        int write_pipe_id = thread->write_pipe ? thread->write_pipe - pipe_buffers : -1;
+        trace_resume(thread - thread_pool, resume_started, resumed_at, n_executed, block_reason, read_pipe_id, write_pipe_id);
+    }
+}
+
+// threads waiting on a pipe are skipped until the other end has done enough to make waking them worthwhile
+int thread_is_ready(InterpreterThread *thread)
+{
+    if (thread->sleeping && thread->timer != -1) return 0;
+
+    PipeBuffer *pipe = thread->blocked_pipe;
+    if (!pipe || pipe->closed || pipe->reader_closed) return 1;
+
+    int occupancy = pipe_occupancy(pipe);
+    if (thread->blocked_reason == BLOCK_REASON_PIPE_FULL)
+    {
+        return occupancy < pipe->high_watermark;
+    }
+
+    // a tee reader only cares about what it hasn't read itself, however far behind the others are
+    int n_available = pipe_available(pipe, thread->read_cursor);
+    if (n_available >= pipe->low_watermark) return 1;
+
+    // the writer went a whole pass without writing anything, so it's waiting on something else - take
+    // whatever it managed to write rather than waiting for the low watermark
+    long n_bytes_written = pipe->stats.n_bytes_written;
+    if (n_available > 0 && n_bytes_written == thread->blocked_pipe_bytes_written) return 1;
+    thread->blocked_pipe_bytes_written = n_bytes_written;
+
+    return 0;
+}
+
+int thread_is_waiting_on_children(InterpreterThread *thread)
+{
+    if (thread->finished || thread->waiting_for_jobs) return thread->n_pending_children > 0;
+    return thread->n_pending_children > thread->n_background_jobs;
+}
+
+// once a finished thread has nothing of its own left running
+void thread_detach_from_parent(InterpreterThread *thread)
+{
+    if (!thread->parent) return;
+
+    thread->parent->n_pending_children -= 1;
+    if (thread->is_background) thread->parent->n_background_jobs -= 1;
+    thread->parent = 0;
+
+    // nothing can refer to it any more, so the slot goes to the next thread to be spawned
+    free_threads[n_free_threads] = thread - thread_pool;
+    n_free_threads += 1;
+}
+
+void scheduler_run_timers()
+{
+    int owner;
+    int kind;
+    while (timers_pop_expired(&owner, &kind) != -1)
+    {
+        InterpreterThread *thread = &thread_pool[owner];
+        if (kind == TIMER_WAKE)
+        {
+            thread->timer = -1;
+        }
+        else
+        {
+            thread->timeout_timer = -1;
+            thread->timed_out = 1;
+            if (thread->awaiting_pid > 0) kill(thread->awaiting_pid, SIGTERM);
+
+            // and wakes it up early
+            if (thread->sleeping && thread->timer != -1)
+            {
+                timer_cancel(thread->timer);
+                thread->timer = -1;
+            }
+        }
+    }
+
+    timers_arm();
 }
 
 void run_program(ASTNode *program)
 {
+    hostio_initialise();
+    timers_initialise();
     spawn_child_thread(0, program);
 
+    int n_idle_passes = 0;
     int done = 0;
     while (!done)
     {
+        long n_productive_resumes_before = n_productive_resumes;
+        scheduler_run_timers();
+
         int all_finished = 1;
         for (int i = 0; i < n_threads; i++)
         {
@@ -867,40 +2512,233 @@ void run_program(ASTNode *program)
                 all_finished = 0;
             }
 
-            if (thread->n_pending_children > 0)
+            if (thread_is_waiting_on_children(thread))
             {
                 continue;
             }
 
             if (thread->finished)
             {
-                if (thread->parent)
-                {
-                    thread->parent->n_pending_children -= 1;
-                    thread->parent = 0; // temporary measure, since currently we don't drop threads from the loop when they're done
-                }
+                thread_detach_from_parent(thread);
+                continue;
+            }
+
+            if (!thread_is_ready(thread))
+            {
                 continue;
             }
 
             resume_execution(thread);
+            scheduler_n_resumes += 1;
         }
 
         if (all_finished) done = 1;
+
+        /*
+        Two passes, because a reader that's waiting for a fuller pipe only gets resumed once its writer has
+        gone a pass without writing. After that nobody can get anywhere until a host process does something.
+        Without pidfds, processes exiting can only be noticed by asking, hence the short timeout.
+        */
+        if (n_productive_resumes == n_productive_resumes_before) n_idle_passes += 1;
+        else n_idle_passes = 0;
+        if (n_idle_passes >= 2 && !done)
+        {
+            hostio_wait(hostio_pidfds_supported ? 50 : 1);
+            n_idle_passes = 0;
+        }
+    }
+}
+
+void print_stats()
+{
+    FILE *file = stderr;
+
+    // slots are reused, so each one only shows its latest thread - the totals cover every thread there was
+    ThreadStats total = retired_thread_stats;
+    fprintf(file, "threads: %d (%ld spawned)\n", n_threads, n_threads + n_retired_threads);
+    for (int i = 0; i < n_threads; i++)
+    {
+        InterpreterThread *thread = &thread_pool[i];
+        ThreadStats *stats = &thread->stats;
+        fprintf(file, "  #%-3d %-14s resumes %ld (productive %ld, blocked %ld, preempted %ld), blocked on full pipe %.6fs, empty pipe %.6fs, host %.6fs\n",
+            i, ast_node_type_name(thread->root->type),
+            stats->n_resumes, stats->n_productive_resumes, stats->n_blocked_resumes, stats->n_preemptions,
+            stats->time_blocked_on_full_pipe, stats->time_blocked_on_empty_pipe, stats->time_blocked_on_host);
+        stats_add_thread(&total, stats);
+    }
+    fprintf(file, "  all  resumes %ld (productive %ld, blocked %ld, preempted %ld), blocked on full pipe %.6fs, empty pipe %.6fs, host %.6fs\n",
+        total.n_resumes, total.n_productive_resumes, total.n_blocked_resumes, total.n_preemptions,
+        total.time_blocked_on_full_pipe, total.time_blocked_on_empty_pipe, total.time_blocked_on_host);
+
+    PipeStats pipe_total = retired_pipe_stats;
+    fprintf(file, "pipes: %d (%ld used)\n", n_pipes_created, n_pipes_created + n_retired_pipes);
+    for (int i = 0; i < n_pipes_created; i++)
+    {
+        PipeBuffer *pipe = &pipe_buffers[i];
+        PipeStats *stats = &pipe->stats;
+        fprintf(file, "  #%-3d %ld bytes written, peak occupancy %d/%d\n",
+            i, stats->n_bytes_written, stats->peak_occupancy, pipe->capacity);
+        stats_add_pipe(&pipe_total, stats);
+
+        // for tees, which consumer the producer spent its time waiting on
+        if (pipe->n_readers == 1) continue;
+        for (int reader = 0; reader < pipe->n_readers; reader++)
+        {
+            int thread_id = -1;
+            for (int j = 0; j < n_threads; j++)
+            {
+                if (thread_pool[j].read_pipe == pipe && thread_pool[j].read_cursor == reader) thread_id = j;
+            }
+            fprintf(file, "       reader %d (thread #%d) held up the writer %ld times\n",
+                reader, thread_id, pipe->n_times_reader_held_up_writer[reader]);
+        }
+    }
+    fprintf(file, "  all  %ld bytes written, peak occupancy %d\n", pipe_total.n_bytes_written, pipe_total.peak_occupancy);
+
+    fprintf(file, "host processes: %d\n", n_host_processes_spawned);
+    fprintf(file, "  host io: %s, %ld waits, %ld requests submitted\n", hostio_backend_name(), hostio_n_waits, hostio_n_submitted);
+    fprintf(file, "timers: %ld started, %ld went off\n", timers_n_started, timers_n_fired);
+    for (int i = 0; i < n_host_process_stats; i++)
+    {
+        HostProcessStats *stats = &host_process_stats[i];
+        fprintf(file, "  %-14s pid %d, spawn %.6fs", stats->program, stats->pid, stats->spawn_latency);
+        if (stats->finished)
+        {
+            double user = stats->usage.ru_utime.tv_sec + stats->usage.ru_utime.tv_usec * 1e-6;
+            double system = stats->usage.ru_stime.tv_sec + stats->usage.ru_stime.tv_usec * 1e-6;
+            fprintf(file, ", wall %.6fs, user %.6fs, sys %.6fs, max rss %ld KiB, exit %d\n",
+                stats->wall_time, user, system, stats->usage.ru_maxrss,
+                WIFEXITED(stats->exit_status) ? WEXITSTATUS(stats->exit_status) : -1);
+        }
+        else
+        {
+            fprintf(file, ", not reaped\n");
+        }
     }
+
+    print_allocation_stats(file);
 }
 
-char input[1024 * 1024];
+char *load_script(char *filename, int *length)
+{
+    int fd = STDIN_FILENO;
+    if (!streq(filename, "-"))
+    {
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) return 0;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && info.st_size < 0x7fffffff)
+    {
+        // map regular files directly - the lexer reads straight out of the page cache and the mapping
+        // is never written to or unmapped, so the AST may keep pointing into it
+        char *mapping = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+            if (fd != STDIN_FILENO) close(fd);
+            *length = info.st_size;
+            return mapping;
+        }
+    }
+
+    // pipes, terminals and anything else we can't map get read into a buffer that grows as needed
+    int capacity = 64 * 1024;
+    int n_read = 0;
+    char *buffer = malloc(capacity);
+    while (1)
+    {
+        if (n_read == capacity)
+        {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+
+        int result = read(fd, buffer + n_read, capacity - n_read);
+        if (result > 0)
+        {
+            n_read += result;
+        }
+        else if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (fd != STDIN_FILENO) close(fd);
+    *length = n_read;
+    return buffer;
+}
 
+#ifndef CHA_NO_MAIN
 int main(int argc, char **argv)
 {
     int do_interpret = 1;
+    int use_cache = 0;
+    int dump_cache = 0;
     char* filename = "input.cha";
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (getenv("CHA_QUANTUM")) scheduler_quantum = atoi(getenv("CHA_QUANTUM"));
+    if (getenv("CHA_PIPE_SIZE")) host_pipe_size = atoi(getenv("CHA_PIPE_SIZE"));
+
     for (int i = 1; i < argc; i++)
     {
         if (streq(argv[i], "-t"))
         {
             do_interpret = 0;
         }
+        else if (streq(argv[i], "--spans"))
+        {
+            do_interpret = 0;
+            print_ast_spans = 1;
+        }
+        else if (streq(argv[i], "-c"))
+        {
+            use_cache = 1;
+        }
+        else if (streq(argv[i], "--stats"))
+        {
+            stats_enabled = 1;
+            atexit(print_stats);
+        }
+        else if (streq(argv[i], "--trace") && i + 1 < argc)
+        {
+            i += 1;
+            if (!trace_open(argv[i]))
+            {
+                printf("Could not open trace file: %s\n", argv[i]);
+                return 1;
+            }
+            atexit(trace_close);
+        }
+        else if (streq(argv[i], "-q") && i + 1 < argc)
+        {
+            i += 1;
+            scheduler_quantum = atoi(argv[i]);
+        }
+        else if (streq(argv[i], "--profile"))
+        {
+            profile_enabled = 1;
+        }
+        else if (streq(argv[i], "--profile-stacks") && i + 1 < argc)
+        {
+            profile_enabled = 1;
+            i += 1;
+            profile_stacks_path = argv[i];
+        }
+        else if (streq(argv[i], "-T"))
+        {
+            do_interpret = 0;
+            use_cache = 1;
+            dump_cache = 1;
+        }
         else
         {
             filename = argv[i];
@@ -908,16 +2746,66 @@ int main(int argc, char **argv)
         }
     }
 
-    FILE *file = fopen(filename, "r");
-    if (!file)
+    int input_length;
+    char *input = load_script(filename, &input_length);
+    if (!input)
     {
         printf("File not found: %s\n", filename);
         return 1;
     }
 
-    int input_length = fread(input, 1, sizeof(input), file);
+    ASTNode *program = 0;
+    char path[1024];
+    unsigned long long script_hash;
+    int have_cache_path = 0;
+    if (use_cache)
+    {
+        script_hash = hash_script(input, input_length);
+        have_cache_path = cache_path(path, sizeof(path), script_hash);
+
+        char **symbol_names;
+        int n_cached_symbols;
+        int status = have_cache_path ? load_cache(path, script_hash, input_length, &program, &symbol_names, &n_cached_symbols, sizeof(symbol_table) / sizeof(symbol_table[0])) : 0;
+        if (status == 1)
+        {
+            for (int i = 0; i < n_cached_symbols; i++)
+            {
+                symbol_table[i].name = symbol_names[i];
+                symbol_table[i].value = 0;
+            }
+            n_symbols = n_cached_symbols;
+        }
+
+        if (dump_cache)
+        {
+            if (!have_cache_path) printf("cache: no cache directory (set CHA_CACHE_DIR or HOME)\n");
+            else if (status == 1) printf("cache: %s is valid (%d symbols)\n", path, n_symbols);
+            else if (status == 0) printf("cache: %s does not exist yet\n", path);
+            else printf("cache: %s is stale or corrupt\n", path);
+            
+            if (status != 1) return 1;
+        }
+    }
     
-    ASTNode *program = parse(input, input_length);
+    if (!program)
+    {
+        program = parse(input, input_length);
+        if (!program) return 1;
+        resolve_symbols(program);
+
+        if (use_cache && have_cache_path)
+        {
+            char *symbol_names[64];
+            for (int i = 0; i < n_symbols; i++) symbol_names[i] = symbol_table[i].name;
+            write_cache(path, program, script_hash, input_length, symbol_names, n_symbols);
+        }
+    }
+
+    if (do_interpret && profile_enabled)
+    {
+        profile_begin(program, input, input_length);
+        atexit(print_profile);
+    }
 
     if (do_interpret)
         run_program(program);
@@ -925,4 +2813,5 @@ int main(int argc, char **argv)
         print_ast(program);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 typedef int LexerChar;
 const LexerChar LexerEOF = -1;
@@ -8,7 +13,8 @@ const LexerChar LexerEOF = -1;
 struct Token
 {
     int type;
-    char text[256];
+    const char *text; // not null-terminated - points into the source, or into the escape buffer for strings with escapes
+    int length;
     int i0, i1;
 };
 
@@ -20,6 +26,11 @@ struct Lexer
     int index;
     int input_length;
     Token token;
+    int previous_token_end;
+
+    // strings containing escape sequences are decoded into here, everything else is referenced in place
+    char *escape_buffer;
+    int escape_buffer_capacity;
 
     // state
     int state;
@@ -38,6 +49,7 @@ enum TokenType
     TOKEN_TYPE_NUMBER,
     TOKEN_TYPE_NEWLINE,
     TOKEN_TYPE_RAW_TEXT,
+    TOKEN_TYPE_VARIABLE, // $name - the token's text is just the name
     
     TOKEN_TYPESET_OP_FIRST,
     TOKEN_TYPE_OPASSIGN,
@@ -48,11 +60,16 @@ enum TokenType
     TOKEN_TYPESET_OP_LAST,
     
     TOKEN_TYPE_PIPE,
+    TOKEN_TYPE_TEE,
+    TOKEN_TYPE_ERROR_PIPE,
+    TOKEN_TYPE_REDIRECT,
+    TOKEN_TYPE_BACKGROUND,
     
     TOKEN_TYPE_PARENOPEN,
     TOKEN_TYPE_PARENCLOSE,
     TOKEN_TYPE_CURLYOPEN,
     TOKEN_TYPE_CURLYCLOSE,
+    TOKEN_TYPE_SUBSTITUTION, // ${, closed by an ordinary }
     
     TOKEN_TYPE_EOF
 };
@@ -64,67 +81,217 @@ void lexer_init(Lexer *lexer, char *file_contents, int length)
     lexer->index = 0;
     lexer->state = LEXER_STATE_INITIAL;
     lexer->checkpoint = 0;
+    lexer->previous_token_end = 0;
+    lexer->escape_buffer = 0;
+    lexer->escape_buffer_capacity = 0;
+}
+
+void lexer_emit(Lexer *lexer, int type, int i0, int i1)
+{
+    Token *token = &lexer->token;
+    lexer->previous_token_end = token->i1;
+    token->type = type;
+    token->i0 = i0;
+    token->i1 = i1;
+    token->text = &lexer->input[i0];
+    token->length = i1 - i0;
+}
+
+int token_is(Token *token, const char *string)
+{
+    int length = strlen(string);
+    return token->length == length && memcmp(token->text, string, length) == 0;
 }
 
 LexerChar lexer_peek(Lexer *lexer)
 {
     if (lexer->index >= lexer->input_length) return LexerEOF;
-    else return lexer->input[lexer->index];
+    else return (unsigned char) lexer->input[lexer->index];
 }
 
 LexerChar lexer_consume(Lexer *lexer)
 {
     if (lexer->index >= lexer->input_length) return LexerEOF;
-    else return lexer->input[lexer->index++];
+    else return (unsigned char) lexer->input[lexer->index++];
 }
 
-int lexer_match(Lexer *lexer, const char *string)
+/*
+Every byte is classified with a single table lookup rather than a chain of comparisons. The classes
+describe runs the lexer wants to skip over in bulk. Most bytes belong to none of them, so they're all left
+out of the table rather than listed.
+*/
+enum CharClass
 {
-    int i = 0;
-    while (string[i] != 0)
+    CHAR_CLASS_NAME_START   = 1 << 0, // _ A-Z a-z
+    CHAR_CLASS_NAME         = 1 << 1, // _ A-Z a-z 0-9
+    CHAR_CLASS_DIGIT        = 1 << 2, // 0-9
+    CHAR_CLASS_SPACE        = 1 << 3, // space and tab
+    CHAR_CLASS_RAW_END      = 1 << 4, // anything that ends raw text, i.e. space or newline
+    CHAR_CLASS_STRING_END   = 1 << 5, // anything inside a string that needs a decision: quotes, backslash, newline
+    CHAR_CLASS_SINGLE       = 1 << 6  // operators and parentheses that are always one character long
+};
+
+#define CHAR_CLASS_LETTER (CHAR_CLASS_NAME_START | CHAR_CLASS_NAME)
+
+const unsigned char lexer_char_class[256] =
+{
+    [' '] = CHAR_CLASS_SPACE | CHAR_CLASS_RAW_END,
+    ['\t'] = CHAR_CLASS_SPACE,
+    ['\n'] = CHAR_CLASS_RAW_END | CHAR_CLASS_STRING_END,
+    ['\\'] = CHAR_CLASS_STRING_END,
+    ['\''] = CHAR_CLASS_STRING_END,
+    ['"'] = CHAR_CLASS_STRING_END,
+    ['_'] = CHAR_CLASS_LETTER,
+    ['A' ... 'Z'] = CHAR_CLASS_LETTER,
+    ['a' ... 'z'] = CHAR_CLASS_LETTER,
+    ['0' ... '9'] = CHAR_CLASS_NAME | CHAR_CLASS_DIGIT,
+    ['+'] = CHAR_CLASS_SINGLE,
+    ['*'] = CHAR_CLASS_SINGLE,
+    ['<'] = CHAR_CLASS_SINGLE,
+    ['('] = CHAR_CLASS_SINGLE,
+    [')'] = CHAR_CLASS_SINGLE,
+};
+
+const unsigned char lexer_single_char_token[256] =
+{
+    ['+'] = TOKEN_TYPE_OPADD,
+    ['*'] = TOKEN_TYPE_OPMULTIPLY,
+    ['<'] = TOKEN_TYPE_OPLESSTHAN,
+    ['('] = TOKEN_TYPE_PARENOPEN,
+    [')'] = TOKEN_TYPE_PARENCLOSE,
+};
+
+// returns the index of the first byte at or after i that isn't in char_class
+int lexer_skip_class(Lexer *lexer, int i, int char_class)
+{
+    const unsigned char *input = (const unsigned char*) lexer->input;
+    const int length = lexer->input_length;
+    while (i < length && (lexer_char_class[input[i]] & char_class))
     {
-        LexerChar c = lexer_consume(lexer);
-        if (c != string[i])
+        i += 1;
+    }
+
+    return i;
+}
+
+// returns the index of the first byte at or after i that is in char_class
+int lexer_skip_until_class(Lexer *lexer, int i, int char_class)
+{
+    const unsigned char *input = (const unsigned char*) lexer->input;
+    const int length = lexer->input_length;
+    while (i < length && !(lexer_char_class[input[i]] & char_class))
+    {
+        i += 1;
+    }
+
+    return i;
+}
+
+int lexer_skip_spaces(Lexer *lexer, int i)
+{
+    const unsigned char *input = (const unsigned char*) lexer->input;
+    const int length = lexer->input_length;
+
+    // most runs are a single space, so go one byte at a time to begin with
+    int short_run_end = i + 16;
+    while (i < length && (lexer_char_class[input[i]] & CHAR_CLASS_SPACE))
+    {
+        i += 1;
+        if (i == short_run_end) break;
+    }
+    if (i != short_run_end) return i;
+
+#ifdef __SSE2__
+    // long runs of indentation are worth checking 16 bytes at a time
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i tabs = _mm_set1_epi8('\t');
+    while (i + 16 <= length)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*) &input[i]);
+        __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(block, spaces), _mm_cmpeq_epi8(block, tabs));
+        int mask = _mm_movemask_epi8(is_space) ^ 0xffff;
+        if (mask)
         {
-            return 0;
+            return i + __builtin_ctz(mask);
         }
-        i += 1;
+        i += 16;
     }
-    return 1;
+#endif
+
+    return lexer_skip_class(lexer, i, CHAR_CLASS_SPACE);
+}
+
+void lexer_reserve_escape_buffer(Lexer *lexer, int size)
+{
+    if (size > lexer->escape_buffer_capacity)
+    {
+        int capacity = lexer->escape_buffer_capacity ? lexer->escape_buffer_capacity : 256;
+        while (capacity < size) capacity *= 2;
+        lexer->escape_buffer = realloc(lexer->escape_buffer, capacity);
+        lexer->escape_buffer_capacity = capacity;
+    }
+}
+
+// the length of the ->, ->>, !->, !->> or <- at i, or 0 if there isn't one
+int lexer_redirect_length(Lexer *lexer, int i)
+{
+    const char *input = lexer->input;
+    const int length = lexer->input_length;
+    if (i + 1 < length && input[i] == '<' && input[i + 1] == '-') return 2;
+
+    int j = i;
+    if (j < length && input[j] == '!') j += 1;
+    if (j + 1 < length && input[j] == '-' && input[j + 1] == '>')
+    {
+        j += 2;
+        if (j < length && input[j] == '>') j += 1;
+        return j - i;
+    }
+
+    return 0;
 }
 
 int lexer_next_token(Lexer *lexer, int shell_mode)
 {
     lexer->checkpoint = lexer->index;
     Token *token = &lexer->token;
+    const char *input = lexer->input;
+    const int length = lexer->input_length;
     while (1)
     {
+        lexer->index = lexer_skip_spaces(lexer, lexer->index);
+
         LexerChar c = lexer_peek(lexer);
         
         if (c == '#')
         {
-            LexerChar c = lexer_consume(lexer);
-            while (c != '\n' && c != LexerEOF)
-            {
-                lexer_consume(lexer);
-                c = lexer_peek(lexer);
-            }
+            // the comment runs up to (but not including) the next newline
+            const char *newline = memchr(&input[lexer->index], '\n', length - lexer->index);
+            lexer->index = newline ? newline - input : length;
         }
         else if (c == '\'' || c == '"')
         {
             // consume strings
             char quotemark = c;
-            int escaped = 0;
-            int string_index = 0;
+            int string_index = -1; // stays -1 until we see an escape and have to start copying
 
-            token->type = TOKEN_TYPE_STRING;
             token->i0 = lexer->index;
-
-            lexer_consume(lexer);
+            int i = lexer->index + 1;
 
             while (1)
             {
-                LexerChar c = lexer_consume(lexer);
+                // skip straight to the next byte that needs a decision
+                int i_plain = lexer_skip_until_class(lexer, i, CHAR_CLASS_STRING_END);
+                if (string_index != -1)
+                {
+                    lexer_reserve_escape_buffer(lexer, string_index + (i_plain - i) + 1);
+                    memcpy(&lexer->escape_buffer[string_index], &input[i], i_plain - i);
+                    string_index += i_plain - i;
+                }
+                i = i_plain;
+
+                LexerChar c = i < length ? (unsigned char) input[i] : LexerEOF;
+                i += 1;
 
                 if (c == '\n' || c == LexerEOF)
                 {
@@ -132,23 +299,26 @@ int lexer_next_token(Lexer *lexer, int shell_mode)
                     printf("Lexer error %d (lexer.c:%d)\n", c, __LINE__);
                     return 0;
                 }
-
-                if (escaped)
+                else if (c == '\\')
                 {
+                    LexerChar c = i < length ? (unsigned char) input[i] : LexerEOF;
+                    i += 1;
+
+                    char decoded;
                     if (c == 'n')
                     {
                         // append newline
-                        token->text[string_index++] = '\n';
+                        decoded = '\n';
                     }
                     else if (c == '\'' || c == '"')
                     {
                         // append c
-                        token->text[string_index++] = c;
+                        decoded = c;
                     }
                     else if (c == '\\')
                     {
                         // append backslash
-                        token->text[string_index++] = '\\';
+                        decoded = '\\';
                     }
                     else
                     {
@@ -156,199 +326,162 @@ int lexer_next_token(Lexer *lexer, int shell_mode)
                         printf("Lexer error %d (lexer.c:%d)\n", c, __LINE__);
                         return 0;   
                     }
-                    escaped = 0;
-                }
-                else
-                {
-                    if (c == '\\')
-                    {
-                        escaped = 1;
-                    }
-                    else if (c == quotemark)
-                    {
-                        // end
-                        token->text[string_index]  = 0;
-                        token->i1 = lexer->index - 1;
-                        return 1;
-                    }
-                    else
+
+                    if (string_index == -1)
                     {
-                        // append
-                        token->text[string_index++] = c;
+                        // first escape in this string - copy everything before the backslash
+                        string_index = i - 2 - (token->i0 + 1);
+                        lexer_reserve_escape_buffer(lexer, string_index + 1);
+                        memcpy(lexer->escape_buffer, &input[token->i0 + 1], string_index);
                     }
+                    lexer_reserve_escape_buffer(lexer, string_index + 1);
+                    lexer->escape_buffer[string_index++] = decoded;
                 }
-            }
-        }
-        else if (c == '\n')
-        {
-            // consume whitespace until either "..." or anything else
-            lexer_consume(lexer);
-            int checkpoint = lexer->index;
-            int n_dots = 0;
-            int backtrack = 0;
-            while (1)
-            {
-                LexerChar c = lexer_peek(lexer);
-                if (c == ' ' || c == '\t')
+                else if (c == quotemark)
                 {
-                    lexer_consume(lexer);
-                    checkpoint = lexer->index; // unnecessary, but technically faster
-                }
-                else if (c == '.')
-                {
-                    if (lexer_match(lexer, "..."))
+                    // end
+                    lexer->index = i;
+                    // the token spans both quotes, so that it ends where the next one could start
+                    lexer_emit(lexer, TOKEN_TYPE_STRING, token->i0, i);
+                    if (string_index == -1)
                     {
-                        break;
+                        // no escapes, so the token can point straight at the source
+                        token->text = &input[token->i0 + 1];
+                        token->length = token->i1 - token->i0 - 2;
                     }
                     else
                     {
-                        backtrack = 1;
+                        token->text = lexer->escape_buffer;
+                        token->length = string_index;
                     }
+                    return 1;
                 }
-                else
-                {
-                    backtrack = 1;
-                }
-
-                if (backtrack)
+                else if (string_index != -1)
                 {
-                    lexer->index = checkpoint;
-                    token->type = TOKEN_TYPE_NEWLINE;
-                    token->text[0] = '\n';
-                    token->text[1] = 0;
-                    token->i0 = checkpoint - 1;
-                    token->i1 = checkpoint;
-                    return 1;
+                    // the other kind of quotemark
+                    lexer_reserve_escape_buffer(lexer, string_index + 1);
+                    lexer->escape_buffer[string_index++] = c;
                 }
             }
         }
-        else if (c == ' ' || c == '\t')
+        else if (c == '\n')
         {
-            lexer_consume(lexer);
+            // consume whitespace until either "..." or anything else
+            int newline = lexer->index;
+            int checkpoint = lexer_skip_spaces(lexer, newline + 1);
+            if (checkpoint + 3 <= length && memcmp(&input[checkpoint], "...", 3) == 0)
+            {
+                // continuation - the newline doesn't count
+                lexer->index = checkpoint + 3;
+            }
+            else
+            {
+                lexer->index = checkpoint;
+                lexer_emit(lexer, TOKEN_TYPE_NEWLINE, newline, newline + 1);
+                return 1;
+            }
         }
         else if (c == '{')
         {
-            token->type = TOKEN_TYPE_CURLYOPEN;
-            token->text[0] = c;
-            token->text[1] = 0;
-            lexer_consume(lexer);
+            lexer_emit(lexer, TOKEN_TYPE_CURLYOPEN, lexer->index, lexer->index + 1);
+            lexer->index += 1;
             return 1;
         }
         else if (c == '}')
         {
-            token->type = TOKEN_TYPE_CURLYCLOSE;
-            token->text[0] = c;
-            token->text[1] = 0;
-            lexer_consume(lexer);
+            lexer_emit(lexer, TOKEN_TYPE_CURLYCLOSE, lexer->index, lexer->index + 1);
+            lexer->index += 1;
+            return 1;
+        }
+        else if (c == '$' && lexer->index + 1 < length && input[lexer->index + 1] == '{')
+        {
+            lexer_emit(lexer, TOKEN_TYPE_SUBSTITUTION, lexer->index, lexer->index + 2);
+            lexer->index += 2;
+            return 1;
+        }
+        else if (c == '$' && lexer->index + 1 < length && (lexer_char_class[(unsigned char) input[lexer->index + 1]] & CHAR_CLASS_NAME_START))
+        {
+            int i0 = lexer->index + 1;
+            lexer->index = lexer_skip_class(lexer, i0 + 1, CHAR_CLASS_NAME);
+            lexer_emit(lexer, TOKEN_TYPE_VARIABLE, i0, lexer->index);
             return 1;
         }
         else if (c == '|')
         {
-            token->type = TOKEN_TYPE_PIPE;
-            lexer_consume(lexer);
+            lexer_emit(lexer, TOKEN_TYPE_PIPE, lexer->index, lexer->index + 1);
+            lexer->index += 1;
+            return 1;
+        }
+        else if ((c == '-' || c == '!' || c == '<') && lexer_redirect_length(lexer, lexer->index))
+        {
+            // comes before both raw text and <, so it works the same after a command or an expression
+            int i0 = lexer->index;
+            lexer->index += lexer_redirect_length(lexer, i0);
+            lexer_emit(lexer, TOKEN_TYPE_REDIRECT, i0, lexer->index);
+            return 1;
+        }
+        else if (c == '!' && lexer->index + 1 < length && input[lexer->index + 1] == '|')
+        {
+            lexer_emit(lexer, TOKEN_TYPE_ERROR_PIPE, lexer->index, lexer->index + 2);
+            lexer->index += 2;
+            return 1;
+        }
+        else if (c == '&' && lexer->index + 1 < length && input[lexer->index + 1] == '|')
+        {
+            lexer_emit(lexer, TOKEN_TYPE_TEE, lexer->index, lexer->index + 2);
+            lexer->index += 2;
+            return 1;
+        }
+        else if (c == '&')
+        {
+            lexer_emit(lexer, TOKEN_TYPE_BACKGROUND, lexer->index, lexer->index + 1);
+            lexer->index += 1;
             return 1;
         }
         else if (c == LexerEOF)
         {
-            token->type = TOKEN_TYPE_EOF;
+            lexer_emit(lexer, TOKEN_TYPE_EOF, lexer->index, lexer->index);
             return 1;
         }
         else
         {
             if (!shell_mode)
             {
-                if (c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+                int i0 = lexer->index;
+                unsigned char char_class = lexer_char_class[c];
+                if (char_class & CHAR_CLASS_NAME_START)
                 {
                     // consume name
-                    char *name_buffer = token->text;
-                    token->type = TOKEN_TYPE_NAME;
-                    token->i0 = lexer->index;
-                    int name_index = 0;
-                    while (1)
-                    {
-                        LexerChar c = lexer_peek(lexer);
-
-                        if (c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
-                        {
-                            name_buffer[name_index++] = c;
-                            lexer_consume(lexer);
-                        }
-                        else
-                        {
-                            name_buffer[name_index] = 0;
-                            token->i1 = lexer->index;
-                            return 1;
-                        }
-                    }
+                    lexer->index = lexer_skip_class(lexer, i0 + 1, CHAR_CLASS_NAME);
+                    lexer_emit(lexer, TOKEN_TYPE_NAME, i0, lexer->index);
+                    return 1;
                 }
-                if (c >= '0' && c <= '9')
+                if (char_class & CHAR_CLASS_DIGIT)
                 {
                     // consume number
-                    char *buffer = token->text;
-                    token->type = TOKEN_TYPE_NUMBER;
-                    token->i0 = lexer->index;
-                    int index = 0;
-                    while (1)
-                    {
-                        LexerChar c = lexer_peek(lexer);
-
-                        if (c >= '0' && c <= '9')
-                        {
-                            buffer[index++] = c;
-                            lexer_consume(lexer);
-                        }
-                        else
-                        {
-                            buffer[index++] = 0;
-                            token->i1 = lexer->index;
-                            return 1;
-                        }
-                    }
+                    lexer->index = lexer_skip_class(lexer, i0 + 1, CHAR_CLASS_DIGIT);
+                    lexer_emit(lexer, TOKEN_TYPE_NUMBER, i0, lexer->index);
+                    return 1;
                 }
                 else if (c == '=')
                 {
-                    lexer_consume(lexer);
-                    LexerChar c = lexer_peek(lexer);
-                    if (c == '=')
+                    if (i0 + 1 < length && input[i0 + 1] == '=')
                     {
-                        lexer_consume(lexer);
-                        token->type = TOKEN_TYPE_OPEQUALS;
+                        lexer_emit(lexer, TOKEN_TYPE_OPEQUALS, i0, i0 + 2);
                     }
                     else
                     {
-                        token->type = TOKEN_TYPE_OPASSIGN;
+                        lexer_emit(lexer, TOKEN_TYPE_OPASSIGN, i0, i0 + 1);
                     }
 
+                    lexer->index = lexer->token.i1;
                     return 1;
                 }
-                else if (c == '+')
-                {
-                    token->type = TOKEN_TYPE_OPADD;
-                    lexer_consume(lexer);
-                    return 1;
-                }
-                else if (c == '*')
-                {
-                    token->type = TOKEN_TYPE_OPMULTIPLY;
-                    lexer_consume(lexer);
-                    return 1;
-                }
-                else if (c == '<')
+                else if (char_class & CHAR_CLASS_SINGLE)
                 {
-                    token->type = TOKEN_TYPE_OPLESSTHAN;
-                    lexer_consume(lexer);
-                    return 1;
-                }
-                else if (c == '(')
-                {
-                    token->type = TOKEN_TYPE_PARENOPEN;
-                    lexer_consume(lexer);
-                    return 1;
-                }
-                else if (c == ')')
-                {
-                    token->type = TOKEN_TYPE_PARENCLOSE;
-                    lexer_consume(lexer);
+                    // single character tokens are looked up rather than compared one by one
+                    lexer_emit(lexer, lexer_single_char_token[c], i0, i0 + 1);
+                    lexer->index += 1;
                     return 1;
                 }
                 else
@@ -360,25 +493,10 @@ int lexer_next_token(Lexer *lexer, int shell_mode)
             if (shell_mode)
             {
                 // consume raw text
-                char *buffer = token->text;
-                token->type = TOKEN_TYPE_RAW_TEXT;
-                token->i0 = lexer->index;
-                int name_index = 0;
-                while (1)
-                {
-                    LexerChar c = lexer_peek(lexer);
-                    if (c == ' ' || c == '\n' || c == LexerEOF)
-                    {
-                        buffer[name_index] = 0;
-                        token->i1 = lexer->index;
-                        return 1;
-                    }
-                    else
-                    {
-                        buffer[name_index++] = c;
-                        lexer_consume(lexer);
-                    }
-                }
+                int i0 = lexer->index;
+                lexer->index = lexer_skip_until_class(lexer, i0, CHAR_CLASS_RAW_END);
+                lexer_emit(lexer, TOKEN_TYPE_RAW_TEXT, i0, lexer->index);
+                return 1;
             }
         }
     }
@@ -400,6 +518,15 @@ int lexer_backtrack_and_go_again(Lexer *lexer, int shell_mode)
     return lexer_next_token(lexer, shell_mode);
 }
 
+// starts again from a token it has already handed out, eg. when a keyword turns out to be the name of a
+// program after all - token is a copy of it, and previous_token_end what that was when it was handed out
+void lexer_rewind(Lexer *lexer, Token *token, int previous_token_end)
+{
+    lexer->index = token->i0;
+    lexer_next_token(lexer, 1);
+    lexer->previous_token_end = previous_token_end;
+}
+
 // int c_main()
 // {
 //     char *input =
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <limits.h>
 
 #include "lexer.c"
 #include "ast.c"
@@ -12,10 +13,22 @@ char *save_string_to_heap(char *string)
 {
     int length = strlen(string);
     char *memory = (char*) malloc(length + 1);
+    allocation_stats.n_strings += 1;
+    allocation_stats.string_bytes += length + 1;
     strcpy(memory, string);
     return memory;
 }
 
+char *save_token_to_heap(Token *token)
+{
+    char *memory = (char*) malloc(token->length + 1);
+    allocation_stats.n_strings += 1;
+    allocation_stats.string_bytes += token->length + 1;
+    memcpy(memory, token->text, token->length);
+    memory[token->length] = 0;
+    return memory;
+}
+
 struct ASTAttachmentPoint
 {
     ASTNode **target;
@@ -31,21 +44,38 @@ struct Parser
     ASTAttachmentPoint stack[64];
     int just_opened_if_statement;
     int stack_size;
+    int n_errors; // every one is reported, but none of them leave a program that's safe to run
 };
 
 typedef struct Parser Parser;
 
+// nodes start out spanning the current token, and parser_end_node stretches them to the last token consumed
+ASTNode *parser_alloc_node(Parser *parser, enum ASTNodeType type)
+{
+    ASTNode *node = alloc_ast_node(type);
+    node->source_start = parser->lexer->token.i0;
+    node->source_end = parser->lexer->token.i1;
+    return node;
+}
+
+void parser_end_node(Parser *parser, ASTNode *node)
+{
+    node->source_end = parser->lexer->previous_token_end;
+}
+
 int OP_PRECEDENCE_NONE = 0;
 int OP_PRECEDENCE_OR = 1;
 int OP_PRECEDENCE_COMPARISON = 2;
 int OP_PRECEDENCE_ADD = 3;
 int OP_PRECEDENCE_MULTIPLY = 4;
 
+ASTNode *parser_consume_substitution(Parser *parser);
+
 ASTNode *parser_consume_expression(Parser *parser, int precedence)
 {
     Lexer *lexer = parser->lexer;
 
-    ASTNode *expression = alloc_ast_node(PROGRAM_NODE);
+    ASTNode *expression = parser_alloc_node(parser, PROGRAM_NODE);
 
     int done = 0;
     int expecting_op = 0;
@@ -57,7 +87,7 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
         {
             if (token_type == TOKEN_TYPE_NAME)
             {
-                char *name = save_string_to_heap(token->text);
+                char *name = save_token_to_heap(token);
                 lexer_next_language_token(parser->lexer);
 
                 if (parser->lexer->token.type == TOKEN_TYPE_PARENOPEN)
@@ -68,6 +98,7 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
                     {
                         // we don't support arguments right now
                         printf("PARSE ERROR: Function arguments are not supported (parser.c:%d)\n", __LINE__);
+                        parser->n_errors += 1;
                         return 0;
                     }
 
@@ -86,7 +117,7 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
             else if (token_type == TOKEN_TYPE_STRING)
             {
                 expression->type = STRING_NODE;
-                expression->string = save_string_to_heap(parser->lexer->token.text);
+                expression->string = save_token_to_heap(&parser->lexer->token);
                 expecting_op = 1;
                 lexer_next_token(parser->lexer, 0);
             }
@@ -96,10 +127,10 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
 
                 int integer_value;
                 {
-                    char *text = token->text;
+                    const char *text = token->text;
                     int i = 0;
                     integer_value = 0;
-                    while (text[i])               
+                    while (i < token->length)
                     {
                         int digit = text[i] - '0';
                         integer_value = integer_value * 10 + digit;
@@ -118,13 +149,22 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
                 if (parser->lexer->token.type != TOKEN_TYPE_PARENCLOSE)
                 {
                     printf("PARSE ERROR: Expected right parenthesis (parser.c:%d)\n", __LINE__);
+                    parser->n_errors += 1;
                 }
                 lexer_next_token(parser->lexer, 0); // consume close paren                
                 expecting_op = 1;
             }
+            else if (token_type == TOKEN_TYPE_SUBSTITUTION)
+            {
+                expression = parser_consume_substitution(parser);
+                if (!expression) return 0;
+                lexer_next_token(parser->lexer, 0); // consume close curly
+                expecting_op = 1;
+            }
             else
             {
                 printf("PARSE ERROR: Unexpected token (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
                 return 0;
             }
         }
@@ -159,7 +199,7 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
             }
             else if (token_type == TOKEN_TYPE_NAME)
             {
-                if (streq(token->text, "or"))
+                if (token_is(token, "or"))
                 {
                     token_is_operator = 1;
                     this_precedence = OP_PRECEDENCE_OR;
@@ -173,6 +213,8 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
                 ASTNode *rhs = parser_consume_expression(parser, this_precedence);
 
                 ASTNode *operation = alloc_ast_node(operator_node_type);                
+                operation->source_start = expression->source_start;
+                operation->source_end = rhs->source_end;
                 ast_attach_child(operation, expression);
                 ast_attach_sibling(expression, rhs);
 
@@ -181,16 +223,216 @@ ASTNode *parser_consume_expression(Parser *parser, int precedence)
             }
             else
             {
+                parser_end_node(parser, expression);
                 return expression;
             }
         }
     }
 
+    parser_end_node(parser, expression);
     return expression;
 }
 
 void parse_statements(Parser *parser, ASTNode *root);
 
+// ${ ... } - the block is parsed like any other. Leaves the closing } as the current token, for the caller to
+// consume in whichever mode comes next
+ASTNode *parser_consume_substitution(Parser *parser)
+{
+    Lexer *lexer = parser->lexer;
+    ASTNode *substitution = parser_alloc_node(parser, SUBSTITUTION_NODE);
+    ASTNode *block = parser_alloc_node(parser, CODEBLOCK_NODE);
+    ast_attach_child(substitution, block);
+
+    lexer_next_shell_token(lexer);
+    parse_statements(parser, block);
+    if (lexer->token.type != TOKEN_TYPE_CURLYCLOSE)
+    {
+        printf("PARSE ERROR: Expected '}' (parser.c:%d)\n", __LINE__);
+        parser->n_errors += 1;
+        return 0;
+    }
+
+    block->source_end = lexer->token.i1;
+    substitution->source_end = lexer->token.i1;
+    return substitution;
+}
+
+// a duration written out, like "2", "0.2", "5s" or "1m" - worked out to a number of whole seconds if it is one,
+// so that days' worth still fit, otherwise to milliseconds. Returns 0 if the token isn't one
+int token_to_duration(Token *token, int *amount, int *unit)
+{
+    const char *text = token->text;
+    int i = 0;
+    long whole = 0;
+    while (i < token->length && text[i] >= '0' && text[i] <= '9' && whole < 1000000000)
+    {
+        whole = whole * 10 + text[i] - '0';
+        i += 1;
+    }
+    if (i == 0) return 0;
+
+    double fraction = 0;
+    double place = 0.1;
+    if (i < token->length && text[i] == '.')
+    {
+        i += 1;
+        while (i < token->length && text[i] >= '0' && text[i] <= '9')
+        {
+            fraction += (text[i] - '0') * place;
+            place /= 10;
+            i += 1;
+        }
+    }
+
+    const char *suffix = text + i;
+    int suffix_length = token->length - i;
+    long unit_ms;
+    if (suffix_length == 0) unit_ms = 1000;
+    else if (suffix_length == 2 && memcmp(suffix, "ms", 2) == 0) unit_ms = 1;
+    else if (suffix_length == 1 && *suffix == 's') unit_ms = 1000;
+    else if (suffix_length == 1 && *suffix == 'm') unit_ms = 60 * 1000;
+    else if (suffix_length == 1 && *suffix == 'h') unit_ms = 60 * 60 * 1000;
+    else if (suffix_length == 1 && *suffix == 'd') unit_ms = 24 * 60 * 60 * 1000;
+    else return 0;
+
+    if (fraction == 0 && unit_ms >= 1000)
+    {
+        long seconds = whole * (unit_ms / 1000);
+        if (seconds > INT_MAX) return 0;
+        *amount = seconds;
+        *unit = DURATION_SECONDS;
+    }
+    else
+    {
+        double ms = (whole + fraction) * unit_ms + 0.5;
+        if (ms > INT_MAX) return 0;
+        *amount = (int) ms;
+        *unit = DURATION_MILLISECONDS;
+    }
+    return 1;
+}
+
+// "2", "0.2", "5s", "500 ms", "$delay" or "$delay ms" - starts at the token after the keyword and leaves the one
+// after the duration as the current token. The unit goes in *unit. Returns 0 if it isn't a duration at all, in
+// which case the caller has to rewind
+ASTNode *parser_consume_duration(Parser *parser, int *unit)
+{
+    Lexer *lexer = parser->lexer;
+    lexer_next_shell_token(lexer);
+    Token *token = &lexer->token;
+
+    ASTNode *duration;
+    int has_suffix;
+    if (token->type == TOKEN_TYPE_VARIABLE)
+    {
+        duration = parser_alloc_node(parser, NAME_NODE);
+        duration->name = save_token_to_heap(token);
+        *unit = DURATION_SECONDS;
+        has_suffix = 0;
+    }
+    else
+    {
+        int amount;
+        if (token->type != TOKEN_TYPE_RAW_TEXT || !token_to_duration(token, &amount, unit)) return 0;
+        duration = parser_alloc_node(parser, NUMBER_NODE);
+        duration->number = amount;
+        char last = token->text[token->length - 1];
+        has_suffix = last < '0' || last > '9';
+    }
+
+    lexer_next_shell_token(lexer);
+    if (!has_suffix && token->type == TOKEN_TYPE_RAW_TEXT && token_is(token, "ms"))
+    {
+        if (*unit == DURATION_SECONDS)
+        {
+            *unit = DURATION_MILLISECONDS;
+        }
+        else
+        {
+            // "0.5 ms" - it's been worked out in milliseconds already
+            duration->number = (duration->number + 500) / 1000;
+        }
+        lexer_next_shell_token(lexer);
+    }
+
+    parser_end_node(parser, duration);
+    return duration;
+}
+
+// "sleep" or "timeout" and their duration - anything that doesn't read as one is left to /bin/sleep or
+// /usr/bin/timeout, so the lexer is rewound and 0 returned
+ASTNode *parser_consume_duration_statement(Parser *parser, enum ASTNodeType type)
+{
+    Lexer *lexer = parser->lexer;
+    Token keyword = lexer->token;
+    int keyword_end = lexer->previous_token_end;
+
+    int unit;
+    ASTNode *duration = parser_consume_duration(parser, &unit);
+    if (!duration)
+    {
+        lexer_rewind(lexer, &keyword, keyword_end);
+        return 0;
+    }
+
+    ASTNode *statement = alloc_ast_node(type);
+    statement->source_start = keyword.i0;
+    statement->source_end = duration->source_end;
+    statement->number = unit;
+    ast_attach_child(statement, duration);
+    return statement;
+}
+
+// "parallel 4 [ordered]" followed by a block - anything else is left to be a program called parallel, so the
+// lexer is rewound and 0 returned. Leaves the { as the current token
+ASTNode *parser_consume_parallel_header(Parser *parser)
+{
+    Lexer *lexer = parser->lexer;
+    Token keyword = lexer->token;
+    int keyword_end = lexer->previous_token_end;
+
+    lexer_next_shell_token(lexer);
+    Token count = lexer->token;
+    int n_workers = 0;
+    int is_integer = count.type == TOKEN_TYPE_RAW_TEXT && count.length <= 4;
+    for (int i = 0; is_integer && i < count.length; i++)
+    {
+        if (count.text[i] < '0' || count.text[i] > '9') is_integer = 0;
+        n_workers = n_workers * 10 + count.text[i] - '0';
+    }
+
+    int ordered = 0;
+    if (is_integer)
+    {
+        lexer_next_shell_token(lexer);
+        if (lexer->token.type == TOKEN_TYPE_RAW_TEXT && token_is(&lexer->token, "ordered"))
+        {
+            ordered = 1;
+            lexer_next_shell_token(lexer);
+        }
+    }
+
+    if (!is_integer || lexer->token.type != TOKEN_TYPE_CURLYOPEN)
+    {
+        lexer_rewind(lexer, &keyword, keyword_end);
+        return 0;
+    }
+
+    if (n_workers < 1 || n_workers > PARALLEL_MAX_WORKERS)
+    {
+        printf("PARSE ERROR: Expected between 1 and %d workers (parser.c:%d)\n", PARALLEL_MAX_WORKERS, __LINE__);
+        parser->n_errors += 1;
+        lexer_rewind(lexer, &keyword, keyword_end);
+        return 0;
+    }
+
+    ASTNode *statement = parser_alloc_node(parser, PARALLEL_NODE);
+    statement->source_start = keyword.i0;
+    statement->number = n_workers | (ordered ? PARALLEL_ORDERED : 0);
+    return statement;
+}
+
 ASTNode *parser_consume_statement(Parser *parser)
 {
     Lexer *lexer = parser->lexer;
@@ -199,53 +441,117 @@ ASTNode *parser_consume_statement(Parser *parser)
 
     if (lexer->token.type == TOKEN_TYPE_CURLYOPEN)
     {
+        statement = parser_alloc_node(parser, CODEBLOCK_NODE);
         lexer_next_shell_token(lexer);
-        statement = alloc_ast_node(CODEBLOCK_NODE);        
         parse_statements(parser, statement);
         if (parser->lexer->token.type != TOKEN_TYPE_CURLYCLOSE)
         {
             printf("PARSE ERROR: Expected '}' (parser.c:%d)\n", __LINE__);
+            parser->n_errors += 1;
             return 0;
         }
         lexer_next_shell_token(lexer);
     }
     else if (lexer->token.type == TOKEN_TYPE_RAW_TEXT)
     {
-        char *text = lexer->token.text;
-        if(streq(text, "print"))
+        Token *token = &lexer->token;
+        if(token_is(token, "print"))
         {
             // print statement
-            statement = alloc_ast_node(PRINT_NODE);
+            statement = parser_alloc_node(parser, PRINT_NODE);
 
             lexer_next_token(parser->lexer, 0);
             ASTNode *argument = parser_consume_expression(parser, OP_PRECEDENCE_NONE);
             
             ast_attach_child(statement, argument);
         }
-        else if(streq(text, "exit"))
+        else if(token_is(token, "exit"))
         {
             // print statement
-            statement = alloc_ast_node(EXIT_NODE);
+            statement = parser_alloc_node(parser, EXIT_NODE);
 
             lexer_next_token(parser->lexer, 0);
             ASTNode *argument = parser_consume_expression(parser, OP_PRECEDENCE_NONE);
             
             ast_attach_child(statement, argument);
         }
-        else if (streq(text, "set"))
+        else if (token_is(token, "parallel") && (statement = parser_consume_parallel_header(parser)))
+        {
+            // parallel statement - "parallel 4 [ordered] { ... }", with the block run by that many workers
+            ASTNode *body = 0;
+            while (!body)
+            {
+                body = parser_consume_statement(parser);
+                if (!body)
+                {
+                    lexer_next_shell_token(lexer);
+                }
+            }
+
+            ast_attach_child(statement, body);
+        }
+        else if (token_is(token, "sleep") && (statement = parser_consume_duration_statement(parser, SLEEP_NODE)))
+        {
+            // sleep statement - "sleep 2", "sleep 0.2" or "sleep 500 ms", which holds up this thread and nothing else
+        }
+        else if (token_is(token, "timeout") && (statement = parser_consume_duration_statement(parser, TIMEOUT_NODE)))
+        {
+            // timeout statement - "timeout 5 statement", and whatever the statement is waiting on is cut short if
+            // it's still going after that long
+            ASTNode *duration = statement->first_child;
+
+            ASTNode *body = 0;
+            while (!body)
+            {
+                body = parser_consume_statement(parser);
+                if (!body)
+                {
+                    lexer_next_shell_token(lexer);
+                }
+            }
+
+            // redirections were taken along with the command, but they're for the whole statement, so the
+            // timeout goes inside them
+            ASTNode *outer = body;
+            ASTNode *redirect = 0;
+            while (body->type == REDIRECT_NODE)
+            {
+                redirect = body;
+                body = body->first_child;
+            }
+
+            statement->source_end = body->source_end;
+            if (redirect)
+            {
+                ASTNode *file = body->next_sibling;
+                body->next_sibling = 0;
+                ast_attach_child(redirect, statement);
+                ast_attach_sibling(statement, file);
+            }
+            ast_attach_sibling(duration, body);
+            if (redirect) statement = outer;
+        }
+        else if (token_is(token, "wait"))
+        {
+            // wait statement - for everything this thread has started with &
+            statement = parser_alloc_node(parser, WAIT_NODE);
+            lexer_next_shell_token(parser->lexer);
+        }
+        else if (token_is(token, "set"))
         {
             // set statement
-            statement = alloc_ast_node(SET_NODE);
+            statement = parser_alloc_node(parser, SET_NODE);
 
             lexer_next_language_token(parser->lexer);
 
             if (parser->lexer->token.type != TOKEN_TYPE_NAME)
             {
                 printf("PARSE ERROR: Expected name (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
             }
 
-            char *name = save_string_to_heap(parser->lexer->token.text);
-            ASTNode *name_node = alloc_ast_node(NAME_NODE);
+            char *name = save_token_to_heap(&parser->lexer->token);
+            ASTNode *name_node = parser_alloc_node(parser, NAME_NODE);
             name_node->name = name;
 
             lexer_next_token(parser->lexer, 0);
@@ -253,6 +559,7 @@ ASTNode *parser_consume_statement(Parser *parser)
             if (parser->lexer->token.type != TOKEN_TYPE_OPASSIGN)
             {
                 printf("PARSE ERROR: Expected '=' (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
             }
             
             lexer_next_token(parser->lexer, 0);
@@ -262,10 +569,10 @@ ASTNode *parser_consume_statement(Parser *parser)
                                               // The interpreter depends on this convention.
             ast_attach_sibling(rhs, name_node);
         }
-        else if (streq(text, "if"))
+        else if (token_is(token, "if"))
         {
             // if statement
-            statement = alloc_ast_node(IF_NODE);
+            statement = parser_alloc_node(parser, IF_NODE);
 
             lexer_next_language_token(parser->lexer);
 
@@ -286,10 +593,10 @@ ASTNode *parser_consume_statement(Parser *parser)
 
             ast_attach_sibling(condition, body);
         }
-        else if (streq(text, "while"))
+        else if (token_is(token, "while"))
         {
             // while statement
-            statement = alloc_ast_node(WHILE_NODE);
+            statement = parser_alloc_node(parser, WHILE_NODE);
 
             lexer_next_language_token(parser->lexer);
 
@@ -310,13 +617,57 @@ ASTNode *parser_consume_statement(Parser *parser)
             
             ast_attach_sibling(condition, body);
         }
+        else if (token_is(token, "for"))
+        {
+            // for statement - "for line in input", the only thing there is to iterate over for now
+            statement = parser_alloc_node(parser, FOR_NODE);
+
+            lexer_next_language_token(parser->lexer);
+
+            if (parser->lexer->token.type != TOKEN_TYPE_NAME)
+            {
+                printf("PARSE ERROR: Expected name (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
+            }
+
+            ASTNode *name_node = parser_alloc_node(parser, NAME_NODE);
+            name_node->name = save_token_to_heap(&parser->lexer->token);
+            ast_attach_child(statement, name_node);
+
+            lexer_next_language_token(parser->lexer);
+            if (!token_is(&parser->lexer->token, "in"))
+            {
+                printf("PARSE ERROR: Expected 'in' (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
+            }
+
+            lexer_next_language_token(parser->lexer);
+            if (!token_is(&parser->lexer->token, "input"))
+            {
+                printf("PARSE ERROR: Expected 'input' (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
+            }
+
+            lexer_next_shell_token(lexer);
+            ASTNode *body = 0;
+            while (!body)
+            {
+                body = parser_consume_statement(parser);
+                if (!body)
+                {
+                    lexer_next_shell_token(lexer);
+                }
+            }
+
+            ast_attach_sibling(name_node, body);
+        }
         else
         {
             // host statement
-            statement = alloc_ast_node(HOST_NODE);
+            statement = parser_alloc_node(parser, HOST_NODE);
 
-            char *program = save_string_to_heap(text);
-            ASTNode *program_node = alloc_ast_node(RAW_TEXT_NODE);
+            char *program = save_token_to_heap(token);
+            ASTNode *program_node = parser_alloc_node(parser, RAW_TEXT_NODE);
             program_node->string = program;
             
             ast_attach_child(statement, program_node);
@@ -325,19 +676,29 @@ ASTNode *parser_consume_statement(Parser *parser)
             lexer_next_shell_token(parser->lexer);
             int t = lexer->token.type;
             ASTNode *previous = program_node;
-            while (t == TOKEN_TYPE_RAW_TEXT || t == TOKEN_TYPE_STRING)
+            while (t == TOKEN_TYPE_RAW_TEXT || t == TOKEN_TYPE_STRING || t == TOKEN_TYPE_SUBSTITUTION || t == TOKEN_TYPE_VARIABLE)
             {
                 // argument
                 ASTNode *argument;
-                if (t == TOKEN_TYPE_RAW_TEXT)
+                if (t == TOKEN_TYPE_SUBSTITUTION)
+                {
+                    argument = parser_consume_substitution(parser);
+                    if (!argument) return 0;
+                }
+                else if (t == TOKEN_TYPE_VARIABLE)
+                {
+                    argument = parser_alloc_node(parser, NAME_NODE);
+                    argument->name = save_token_to_heap(&lexer->token);
+                }
+                else if (t == TOKEN_TYPE_RAW_TEXT)
                 {
-                    argument = alloc_ast_node(RAW_TEXT_NODE);
-                    argument->string = save_string_to_heap(lexer->token.text);
+                    argument = parser_alloc_node(parser, RAW_TEXT_NODE);
+                    argument->string = save_token_to_heap(&lexer->token);
                 }
                 else
                 {
-                    argument = alloc_ast_node(STRING_NODE);
-                    argument->string = save_string_to_heap(lexer->token.text);
+                    argument = parser_alloc_node(parser, STRING_NODE);
+                    argument->string = save_token_to_heap(&lexer->token);
                 }
 
                 ast_attach_sibling(previous, argument);
@@ -350,6 +711,38 @@ ASTNode *parser_consume_statement(Parser *parser)
         }
     }
 
+    if (statement) parser_end_node(parser, statement);
+
+    // redirections belong to the statement right before them, so "a <- in -> out" wraps a twice
+    while (statement && lexer->token.type == TOKEN_TYPE_REDIRECT)
+    {
+        Token *token = &lexer->token;
+        ASTNode *redirect = parser_alloc_node(parser, REDIRECT_NODE);
+        redirect->source_start = statement->source_start;
+        if (token_is(token, "<-")) redirect->number = REDIRECT_STDIN;
+        else if (token_is(token, "->")) redirect->number = REDIRECT_STDOUT;
+        else if (token_is(token, "->>")) redirect->number = REDIRECT_STDOUT_APPEND;
+        else if (token_is(token, "!->")) redirect->number = REDIRECT_STDERR;
+        else redirect->number = REDIRECT_STDERR_APPEND;
+
+        lexer_next_shell_token(lexer);
+        if (token->type != TOKEN_TYPE_RAW_TEXT && token->type != TOKEN_TYPE_STRING)
+        {
+            printf("PARSE ERROR: Expected a file name (parser.c:%d)\n", __LINE__);
+            parser->n_errors += 1;
+            return 0;
+        }
+
+        ASTNode *file = parser_alloc_node(parser, token->type == TOKEN_TYPE_STRING ? STRING_NODE : RAW_TEXT_NODE);
+        file->string = save_token_to_heap(token);
+        ast_attach_child(redirect, statement);
+        ast_attach_sibling(statement, file);
+
+        lexer_next_shell_token(lexer);
+        parser_end_node(parser, redirect);
+        statement = redirect;
+    }
+
     return statement;
 }
 
@@ -360,20 +753,36 @@ ASTNode *parser_consume_statement_chain(Parser *parser)
 
     int expecting_op = 0;
     int done = 0;
+    int background = 0;
     while (!done)
     {
         ASTNode *statement = parser_consume_statement(parser);
         ASTNode *statement_or_pipe = statement;
 
+        // tees and stderr pipes are built exactly like pipes - it's only the interpreter that treats them differently
+        enum ASTNodeType link_type = PIPE_NODE;
+        if (parser->lexer->token.type == TOKEN_TYPE_TEE) link_type = TEE_NODE;
+        if (parser->lexer->token.type == TOKEN_TYPE_ERROR_PIPE) link_type = ERROR_PIPE_NODE;
+
         switch (parser->lexer->token.type)
         {
             case TOKEN_TYPE_PIPE:
+            case TOKEN_TYPE_TEE:
+            case TOKEN_TYPE_ERROR_PIPE:
             lexer_next_shell_token(parser->lexer);
-            ASTNode *pipe = alloc_ast_node(PIPE_NODE);
+            ASTNode *pipe = alloc_ast_node(link_type);
+            pipe->source_start = statement->source_start;
+            pipe->source_end = statement->source_end;
             ast_attach_child(pipe, statement);
             statement_or_pipe = pipe;
             break;
 
+            case TOKEN_TYPE_BACKGROUND:
+            lexer_next_shell_token(parser->lexer);
+            background = 1;
+            done = 1;
+            break;
+
             case TOKEN_TYPE_NEWLINE:
             case TOKEN_TYPE_CURLYOPEN:
             case TOKEN_TYPE_CURLYCLOSE:
@@ -383,6 +792,7 @@ ASTNode *parser_consume_statement_chain(Parser *parser)
 
             default:
             printf("PARSE ERROR: Unexpected token (%d) (parser.c:%d)\n", parser->lexer->token.type, __LINE__);
+            parser->n_errors += 1;
             done = 1;
             break;
         }
@@ -397,6 +807,16 @@ ASTNode *parser_consume_statement_chain(Parser *parser)
         previous = statement;
     }
 
+    // & applies to the whole chain, not just its last statement
+    if (background && chain)
+    {
+        ASTNode *job = alloc_ast_node(BACKGROUND_NODE);
+        job->source_start = chain->source_start;
+        job->source_end = parser->lexer->previous_token_end;
+        ast_attach_child(job, chain);
+        chain = job;
+    }
+
     return chain;
 }
 
@@ -431,6 +851,8 @@ void parse_statements(Parser *parser, ASTNode *root)
             lexer_next_shell_token(parser->lexer);
 
             ASTNode *code_block = alloc_ast_node(CODEBLOCK_NODE);            
+            code_block->source_start = parser->lexer->previous_token_end - 1; // the '{' we just consumed
+
             if (!have_first)
             {
                 ast_attach_child(previous, code_block);
@@ -445,9 +867,11 @@ void parse_statements(Parser *parser, ASTNode *root)
             if (parser->lexer->token.type != TOKEN_TYPE_CURLYCLOSE)
             {
                 printf("PARSE ERROR: Expected '}' (parser.c:%d)\n", __LINE__);
+                parser->n_errors += 1;
             }
 
             lexer_next_language_token(parser->lexer);
+            parser_end_node(parser, code_block);
             break;
 
             case TOKEN_TYPE_NEWLINE:
@@ -465,6 +889,7 @@ void parse_statements(Parser *parser, ASTNode *root)
     }
 }
 
+// returns 0 if there were any errors, once they've all been reported
 ASTNode *parse(char *input, int input_length)
 {
     Lexer lexer[1];
@@ -472,10 +897,13 @@ ASTNode *parse(char *input, int input_length)
     
     Parser parser[1];
     parser->lexer = lexer;
+    parser->n_errors = 0;
 
     ASTNode *program = alloc_ast_node(PROGRAM_NODE);
+    program->source_end = input_length;
     lexer_next_shell_token(parser->lexer);
     parse_statements(parser, program);
 
+    if (parser->n_errors > 0) return 0;
     return program;
 }
\ No newline at end of file
@@ -1,189 +1,398 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
 
+// the capacity of pipes that a script reads or writes - ones that only ever go between host processes are
+// made bigger, see pipe_set_capacity
 const int PIPE_BUFFER_SIZE = 1024;
 
+enum { PIPE_MAX_READERS = 8 };
+
+/*
+Positions count every byte that has ever gone through the pipe, and the byte at a position lives at
+data[position % capacity]. Each reader has its own read position - a plain pipe has just the one,
+a tee has one per consumer - and space only becomes free again once the slowest open reader is past it.
+
+Writers yield once a pipe is filled past the high watermark, and readers waiting on an empty pipe aren't
+woken until it has been filled to the low watermark (or the writer stops), so that both ends work in
+batches instead of handing over a line at a time.
+*/
 struct PipeBuffer
 {
-    char data[PIPE_BUFFER_SIZE];
-    char unsent_data[PIPE_BUFFER_SIZE];
-    int write_offset;
-    int read_offset;
-    int lap_flag;
-    int n_unsent_bytes;
+    char *data;
+    int capacity;
+    int allocated; // size of data, which is kept when the pipe is released and handed out again
+    long write_position;
+    long read_positions[PIPE_MAX_READERS];
+    int reader_finished[PIPE_MAX_READERS];
+    long n_times_reader_held_up_writer[PIPE_MAX_READERS];
+    int n_readers;
     int n_writers;
-    int closed;
+    int closed; // every writer is done
+    int reader_closed; // every reader is done, so anything written from now on would go nowhere
+
+    int high_watermark;
+    int low_watermark;
+
+    PipeStats stats;
 };
 
 typedef struct PipeBuffer PipeBuffer;
 
 PipeBuffer pipe_buffers[64];
-int n_pipes_in_use = 0;
+int n_pipes_created = 0;
+
+// pipes nothing can reach any more, which are handed out again ahead of ones that have never been used
+PipeBuffer *free_pipes[64];
+int n_free_pipes = 0;
+
+// only while the pipe is still empty
+void pipe_set_capacity(PipeBuffer *pipe, int capacity)
+{
+    if (capacity > pipe->allocated)
+    {
+        pipe->data = realloc(pipe->data, capacity);
+        pipe->allocated = capacity;
+    }
+
+    pipe->capacity = capacity;
+    pipe->high_watermark = capacity * 3 / 4;
+    pipe->low_watermark = capacity / 4;
+}
 
+// pipes start out with a single reader, number 0, and PIPE_BUFFER_SIZE bytes of room
 PipeBuffer *acquire_internal_pipe()
 {
-    PipeBuffer *pipe = &pipe_buffers[n_pipes_in_use];
-    pipe->write_offset = 0;
-    pipe->read_offset = 0;
-    pipe->lap_flag = 0;
-    pipe->n_unsent_bytes = 0;
+    PipeBuffer *pipe;
+    if (n_free_pipes > 0)
+    {
+        n_free_pipes -= 1;
+        pipe = free_pipes[n_free_pipes];
+        stats_retire_pipe(&pipe->stats);
+    }
+    else if (n_pipes_created < sizeof(pipe_buffers) / sizeof(pipe_buffers[0]))
+    {
+        pipe = &pipe_buffers[n_pipes_created];
+        n_pipes_created += 1;
+    }
+    else
+    {
+        printf("ERROR: Too many pipes (%s:%d)\n", __FILE__, __LINE__);
+        exit(1);
+    }
+
+    pipe->write_position = 0;
+    pipe->read_positions[0] = 0;
+    pipe->reader_finished[0] = 0;
+    pipe->n_times_reader_held_up_writer[0] = 0;
+    pipe->n_readers = 1;
     pipe->closed = 0;
+    pipe->reader_closed = 0;
     pipe->n_writers = 0;
-    n_pipes_in_use += 1;
+    pipe_set_capacity(pipe, PIPE_BUFFER_SIZE);
+    pipe->stats.n_bytes_written = 0;
+    pipe->stats.peak_occupancy = 0;
     return pipe;
 }
 
-const int PIPE_READ_BUFFER_SIZE = PIPE_BUFFER_SIZE;
-char GLOBAL_PIPE_READ_BUFFER[1024];
+// only once every thread that had it as one of its pipes is finished
+void release_internal_pipe(PipeBuffer *pipe)
+{
+    free_pipes[n_free_pipes] = pipe;
+    n_free_pipes += 1;
+}
 
-int pipe_read(PipeBuffer *read_pipe)
+// another reader that sees everything written from now on, or -1 if the pipe already has as many as it can
+int pipe_add_reader(PipeBuffer *pipe)
 {
-    int j = 0;
-    int i = read_pipe->read_offset;
-    int original_offset = read_pipe->read_offset;
-    char *data = read_pipe->data;    
-    while (1)
+    if (pipe->n_readers == PIPE_MAX_READERS) return -1;
+
+    int reader = pipe->n_readers;
+    pipe->read_positions[reader] = pipe->write_position;
+    pipe->reader_finished[reader] = 0;
+    pipe->n_times_reader_held_up_writer[reader] = 0;
+    pipe->n_readers += 1;
+    return reader;
+}
+
+void pipe_close_reader(PipeBuffer *pipe, int reader)
+{
+    pipe->reader_finished[reader] = 1;
+
+    int all_finished = 1;
+    for (int i = 0; i < pipe->n_readers; i++)
     {
-        int is_more_data = 1;
-        if (i >= read_pipe->write_offset)
-        {   
-            is_more_data = read_pipe->lap_flag;
-        }
-        if (!is_more_data) break;
+        if (!pipe->reader_finished[i]) all_finished = 0;
+    }
+    if (all_finished) pipe->reader_closed = 1;
+}
 
-        GLOBAL_PIPE_READ_BUFFER[j++] = data[i++];
+// the open reader furthest behind, which is the one holding up the writer when the pipe is full
+int pipe_slowest_reader(PipeBuffer *pipe)
+{
+    if (pipe->n_readers == 1) return pipe->reader_finished[0] ? -1 : 0;
 
-        if (i >= PIPE_BUFFER_SIZE)
-        {
-            i = 0;
-            read_pipe->lap_flag = 0;
-        }
+    int slowest = -1;
+    for (int i = 0; i < pipe->n_readers; i++)
+    {
+        if (pipe->reader_finished[i]) continue;
+        if (slowest == -1 || pipe->read_positions[i] < pipe->read_positions[slowest]) slowest = i;
     }
 
-    read_pipe->read_offset = i;
+    return slowest;
+}
+
+// bytes written but not yet read by every open reader
+int pipe_occupancy(PipeBuffer *pipe)
+{
+    int slowest = pipe_slowest_reader(pipe);
+    if (slowest == -1) return 0;
+    return pipe->write_position - pipe->read_positions[slowest];
+}
+
+int pipe_free_space(PipeBuffer *pipe)
+{
+    return pipe->capacity - pipe_occupancy(pipe);
+}
+
+// bytes this particular reader hasn't read yet
+int pipe_available(PipeBuffer *pipe, int reader)
+{
+    return pipe->write_position - pipe->read_positions[reader];
+}
+
+// for --stats, so a tee can say which of its consumers is the one causing backpressure
+void pipe_count_full(PipeBuffer *pipe)
+{
+    int slowest = pipe_slowest_reader(pipe);
+    if (slowest != -1) pipe->n_times_reader_held_up_writer[slowest] += 1;
+}
+
+const int PIPE_READ_BUFFER_SIZE = PIPE_BUFFER_SIZE;
+char GLOBAL_PIPE_READ_BUFFER[1024];
+
+// copies everything the reader hasn't seen yet into GLOBAL_PIPE_READ_BUFFER, or as much of it as fits
+int pipe_read(PipeBuffer *read_pipe, int reader)
+{
+    long position = read_pipe->read_positions[reader];
+    int n_bytes = read_pipe->write_position - position;
+    if (n_bytes > PIPE_READ_BUFFER_SIZE) n_bytes = PIPE_READ_BUFFER_SIZE;
+    int offset = position % read_pipe->capacity;
+
+    int n_first = read_pipe->capacity - offset;
+    if (n_first > n_bytes) n_first = n_bytes;
+    memcpy(GLOBAL_PIPE_READ_BUFFER, &read_pipe->data[offset], n_first);
+    memcpy(GLOBAL_PIPE_READ_BUFFER + n_first, read_pipe->data, n_bytes - n_first);
 
-    return j;
+    read_pipe->read_positions[reader] = position + n_bytes;
+
+    return n_bytes;
+}
+
+// the reader's unread bytes that sit in one piece in the ring, to be written out without copying them first
+int pipe_peek(PipeBuffer *pipe, int reader, char **data)
+{
+    long position = pipe->read_positions[reader];
+    int n_available = pipe->write_position - position;
+    int start = position % pipe->capacity;
+    if (n_available > pipe->capacity - start) n_available = pipe->capacity - start;
+
+    *data = &pipe->data[start];
+    return n_available;
 }
 
-int pipe_read_line(PipeBuffer *read_pipe, char *buffer)
+// all of the reader's unread bytes, as one or two pieces depending on whether they wrap around the ring -
+// returns how many pieces
+int pipe_peek_all(PipeBuffer *pipe, int reader, struct iovec *pieces)
+{
+    long position = pipe->read_positions[reader];
+    int n_available = pipe->write_position - position;
+    if (n_available == 0) return 0;
+
+    int start = position % pipe->capacity;
+    int n_first = pipe->capacity - start;
+    if (n_first > n_available) n_first = n_available;
+
+    pieces[0].iov_base = &pipe->data[start];
+    pieces[0].iov_len = n_first;
+    pieces[1].iov_base = pipe->data;
+    pieces[1].iov_len = n_available - n_first;
+    return n_available > n_first ? 2 : 1;
+}
+
+/*
+Finds the reader's next whole line without consuming it, and returns how many bytes it takes up (newline
+included) so the caller can pipe_consume it once it's done with it, or 0 if there isn't a whole line yet.
+A line that sits in one piece in the ring is handed out in place, with its newline overwritten by a NUL -
+only one that wraps around the end of the ring gets copied, into *copy. Tees have other readers that still
+need the newline, so there every line is copied.
+
+A line longer than the whole ring would never fit in it, so once the ring is full without a newline in it
+what's there is consumed into *copy, with *n_partial keeping track of how much of the line that is so far,
+and the rest is put after it once it comes.
+*/
+int pipe_peek_line(PipeBuffer *pipe, int reader, char **line, char **copy, int *copy_capacity, int *n_partial)
 {
-    int j = 0;
-    int i = read_pipe->read_offset;
-    int original_offset = read_pipe->read_offset;
-    char *data = read_pipe->data;
-    int is_more_data = 1;
-    while (is_more_data)
+    long position = pipe->read_positions[reader];
+    int n_available = pipe->write_position - position;
+    int start = position % pipe->capacity;
+    int n_first = pipe->capacity - start;
+    if (n_first > n_available) n_first = n_available;
+
+    int n_line;
+    char *newline = memchr(&pipe->data[start], '\n', n_first);
+    if (newline)
     {
-        char c = data[i];
-        i += 1;
-        if (c == '\n')
+        n_line = newline - &pipe->data[start];
+        if (pipe->n_readers == 1 && *n_partial == 0)
         {
-            break;
+            *newline = 0;
+            *line = &pipe->data[start];
+            return n_line + 1;
         }
-        buffer[j] = c;
-        j += 1;
-
-        if (i >= read_pipe->write_offset)
+        n_first = n_line;
+    }
+    else
+    {
+        newline = memchr(pipe->data, '\n', n_available - n_first);
+        if (newline)
         {
-            is_more_data = read_pipe->lap_flag;
+            n_line = n_first + (newline - pipe->data);
         }
-
-        if (i >= PIPE_BUFFER_SIZE)
+        else if (n_available < pipe->capacity)
         {
-            i = 0;
-            read_pipe->lap_flag = 0;
+            return 0;
+        }
+        else
+        {
+            n_line = n_available;
         }
     }
 
-    read_pipe->read_offset = i;
-    buffer[j] = 0;
+    int n_copied = *n_partial + n_line;
+    if (n_copied + 1 > *copy_capacity)
+    {
+        *copy_capacity = *copy_capacity * 2 > n_copied + 1 ? *copy_capacity * 2 : n_copied + 1;
+        *copy = realloc(*copy, *copy_capacity);
+    }
+    memcpy(*copy + *n_partial, &pipe->data[start], n_first);
+    memcpy(*copy + *n_partial + n_first, pipe->data, n_line - n_first);
 
-    if (!is_more_data)
+    if (!newline)
     {
-        // we ran out of data looking for a newline
-        read_pipe->read_offset = original_offset;
+        pipe->read_positions[reader] = position + n_line;
+        *n_partial = n_copied;
         return 0;
     }
 
-    return 1;
+    (*copy)[n_copied] = 0;
+    *n_partial = 0;
+    *line = *copy;
+    return n_line + 1;
 }
 
-int pipe_write(PipeBuffer *write_pipe, char *data, int n_bytes)
+void pipe_consume(PipeBuffer *pipe, int reader, int n_bytes)
+{
+    pipe->read_positions[reader] += n_bytes;
+}
+
+// n_bytes more have been put in after the write position
+void pipe_commit(PipeBuffer *pipe, int n_bytes)
 {
-    const int read_offset = write_pipe->read_offset;
+    pipe->write_position += n_bytes;
 
+    pipe->stats.n_bytes_written += n_bytes;
+    int occupancy = pipe_occupancy(pipe);
+    if (occupancy > pipe->stats.peak_occupancy) pipe->stats.peak_occupancy = occupancy;
+}
+
+int pipe_write(PipeBuffer *write_pipe, char *data, int n_bytes)
+{
+    if (n_bytes > pipe_free_space(write_pipe))
     {
-        const int write_offset = write_pipe->write_offset;
-        const int is_overflow = write_pipe->lap_flag;
+        pipe_count_full(write_pipe);
+        return 0;
+    }
 
-        int n_bytes_of_space;
-        if (is_overflow)
-        {
-            n_bytes_of_space = read_offset - write_offset;
-        }
-        else
-        {
-            int n_available_before_wraparound = PIPE_BUFFER_SIZE - write_offset;
-            int n_available_after_wraparound = read_offset;
-            n_bytes_of_space = n_available_before_wraparound + n_available_after_wraparound;
-        }
+    int offset = write_pipe->write_position % write_pipe->capacity;
+    int n_first = write_pipe->capacity - offset;
+    if (n_first > n_bytes) n_first = n_bytes;
+    memcpy(&write_pipe->data[offset], data, n_first);
+    memcpy(write_pipe->data, data + n_first, n_bytes - n_first);
+
+    pipe_commit(write_pipe, n_bytes);
+
+    return 1;
+}
+
+/*
+Reads from fd straight into the pipe's free space, all of it in one readv even when it wraps around the
+ring, so a host process with a lot to say is emptied in as few calls as the pipe's capacity allows. Returns
+what readv returned - the caller has to make sure there's some free space first, or it would look like EOF.
+*/
+int pipe_read_from_fd(PipeBuffer *pipe, int fd)
+{
+    int n_free = pipe_free_space(pipe);
+    int offset = pipe->write_position % pipe->capacity;
+    int n_first = pipe->capacity - offset;
+    if (n_first > n_free) n_first = n_free;
+
+    struct iovec pieces[2];
+    pieces[0].iov_base = &pipe->data[offset];
+    pieces[0].iov_len = n_first;
+    pieces[1].iov_base = pipe->data;
+    pieces[1].iov_len = n_free - n_first;
+
+    int result = readv(fd, pieces, n_free > n_first ? 2 : 1);
+    if (result > 0) pipe_commit(pipe, result);
+    return result;
+}
 
-        if (n_bytes > n_bytes_of_space)
+// the line and then a newline, 1 once it's all in. Lines that fit in the pipe are written in one go, so they
+// wait until there's room; lines longer than the whole pipe have to go in pieces, with *offset remembering
+// how far it got
+int pipe_write_line(PipeBuffer *pipe, char *line, int length, int *offset)
+{
+    int n_total = length + 1;
+    if (n_total <= pipe->capacity && pipe_free_space(pipe) < n_total)
+    {
+        pipe_count_full(pipe);
+        return 0;
+    }
+
+    while (*offset < n_total)
+    {
+        int n_free = pipe_free_space(pipe);
+        if (n_free == 0)
         {
+            pipe_count_full(pipe);
             return 0;
         }
-    }
 
-    int buffer_offset = write_pipe->write_offset;
-    int source_offset = 0;
-    int source_length = n_bytes;
-    
-    int allowed_to_write = 1;
-    int is_data_left = source_offset < source_length;
-    while (allowed_to_write && is_data_left)
-    {
-        if (write_pipe->lap_flag && buffer_offset >= read_offset)
+        if (*offset < length)
         {
-            allowed_to_write = 0;
+            int n_bytes = length - *offset;
+            if (n_bytes > n_free) n_bytes = n_free;
+            pipe_write(pipe, line + *offset, n_bytes);
+            *offset += n_bytes;
         }
         else
         {
-            char *destination = &write_pipe->data[buffer_offset];
-            *destination = data[source_offset];
-            source_offset += 1;
-            is_data_left = source_offset < source_length;
-
-            buffer_offset += 1;
-            if (buffer_offset >= sizeof(write_pipe->data))
-            {
-                buffer_offset = 0;
-                write_pipe->lap_flag = 1;
-            }
+            pipe_write(pipe, "\n", 1);
+            *offset += 1;
         }
     }
 
-    write_pipe->write_offset = buffer_offset;
-
-    if (is_data_left)
-    {
-        // error - should never happen since we make sure we have enough space before writing
-        printf("ERROR: Buffer overflow (interpreter.c:%d)\n", __LINE__);
-    }
-
+    *offset = 0;
     return 1;
 }
 
-void pipe_try_to_flush_unsent(PipeBuffer *pipe)
-{
-    int success = pipe_write(pipe, pipe->unsent_data, pipe->n_unsent_bytes);
-    if (success)
-    {
-        pipe->n_unsent_bytes = 0;
-    }
-}
-
 void print_pipe_state(PipeBuffer *pipe)
 {
-    int size = sizeof(pipe->data);
+    int size = pipe->capacity;
     for (int i = 0; i < size; i += 1)
     {
         char c = pipe->data[i];
@@ -201,32 +410,148 @@ void print_pipe_state(PipeBuffer *pipe)
         }
     }
 
-    if (pipe->lap_flag)
+    printf("  written %ld, occupancy %d\n", pipe->write_position, pipe_occupancy(pipe));
+}
+
+/*
+Script input from stdin (or from a file, with <-), read in big blocks instead of a byte at a time. Lines are
+handed out in place like pipe_peek_line does, and stay in the buffer until consumed. Anything still buffered
+when a host process takes over the input is passed on to it first (see thread_write_to_host).
+*/
+struct InputBuffer
+{
+    int fd; // 0 for stdin_buffer, which is never explicitly set up
+    char *data;
+    int capacity;
+    int start;
+    int end;
+    int finished;
+    int sendfile_unsupported; // fd isn't a file, so it has to be read and written by hand
+};
+
+typedef struct InputBuffer InputBuffer;
+
+InputBuffer stdin_buffer;
+
+// one read's worth more input, after whatever is already buffered - returns what read returned
+int input_buffer_fill(InputBuffer *input)
+{
+    if (input->start > 0)
     {
-        printf("  OVERFLOW");
+        memmove(input->data, &input->data[input->start], input->end - input->start);
+        input->end -= input->start;
+        input->start = 0;
     }
-    printf("\n");
 
-    for (int i = 0; i < size; i += 1)
+    if (input->end + 1 >= input->capacity)
     {
-        if (i == pipe->write_offset && i == pipe->read_offset)
-        {
-            putc('X', stdout);
-        }
-        else if (i == pipe->write_offset)
-        {
-            putc('^', stdout);
-        }
-        else if (i == pipe->read_offset)
+        input->capacity = input->capacity ? input->capacity * 2 : 64 * 1024;
+        input->data = realloc(input->data, input->capacity);
+    }
+
+    int result = read(input->fd, &input->data[input->end], input->capacity - 1 - input->end);
+    if (result > 0)
+    {
+        input->end += result;
+    }
+    else if (!(result == -1 && errno == EINTR))
+    {
+        input->finished = 1;
+    }
+
+    return result;
+}
+
+// blocks until there's a whole line (or the input ends), returns 0 only once there's nothing left at all
+int input_buffer_peek_line(InputBuffer *input, char **line)
+{
+    while (1)
+    {
+        char *newline = input->end > input->start ? memchr(&input->data[input->start], '\n', input->end - input->start) : 0;
+        if (newline)
         {
-            putc('v', stdout);
+            *newline = 0;
+            *line = &input->data[input->start];
+            return newline - *line + 1;
         }
-        else
+
+        if (input->finished)
         {
-            putc(' ', stdout);
+            if (input->start == input->end) return 0;
+
+            // last line without a newline - there's always a spare byte at the end for its NUL
+            input->data[input->end] = 0;
+            *line = &input->data[input->start];
+            return input->end - input->start;
         }
+
+        input_buffer_fill(input);
     }
+}
 
-    printf("\n");
-    printf("\n");
-}
\ No newline at end of file
+void input_buffer_consume(InputBuffer *input, int n_bytes)
+{
+    input->start += n_bytes;
+    if (input->start > input->end) input->start = input->end;
+}
+
+/*
+Gives back whatever has been read ahead but not consumed, so the fd can be handed to a host process as is
+and it carries on from exactly where the script left off. Only files can seek, so this fails on pipes and
+terminals, which then have to be fed through the interpreter.
+*/
+int input_buffer_unread(InputBuffer *input)
+{
+    int n_unread = input->end - input->start;
+    if (n_unread > 0 && lseek(input->fd, -n_unread, SEEK_CUR) == -1) return 0;
+
+    input->start = 0;
+    input->end = 0;
+    input->finished = 0;
+    return 1;
+}
+
+/*
+Where ${ ... } collects its block's output. Prints are appended and host output is read straight into the
+end of it, so the whole thing can become a string value without ever going through a PipeBuffer.
+*/
+struct CaptureBuffer
+{
+    char *data;
+    long size;
+    long capacity;
+};
+
+typedef struct CaptureBuffer CaptureBuffer;
+
+// always leaves room for a NUL after the data
+void capture_buffer_reserve(CaptureBuffer *capture, long n_bytes)
+{
+    if (capture->size + n_bytes + 1 > capture->capacity)
+    {
+        long capacity = capture->capacity ? capture->capacity : 4096;
+        while (capture->size + n_bytes + 1 > capacity) capacity *= 2;
+        capture->data = realloc(capture->data, capacity);
+        capture->capacity = capacity;
+    }
+}
+
+void capture_buffer_write(CaptureBuffer *capture, const char *data, long n_bytes)
+{
+    capture_buffer_reserve(capture, n_bytes);
+    memcpy(&capture->data[capture->size], data, n_bytes);
+    capture->size += n_bytes;
+}
+
+// returns what read returned
+int capture_buffer_read(CaptureBuffer *capture, int fd)
+{
+    // grows along with the output, so big outputs take fewer reads
+    long n_free = capture->capacity - capture->size - 1;
+    if (n_free < 4096) capture_buffer_reserve(capture, capture->capacity > 4096 ? capture->capacity : 4096);
+    n_free = capture->capacity - capture->size - 1;
+
+    int result = read(fd, &capture->data[capture->size], n_free);
+    if (result > 0) capture->size += result;
+    return result;
+}
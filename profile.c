@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/*
+Script profiler for --profile. Executions and allocations are counted exactly, per AST node, from inside
+resume_execution. Time is sampled: a SIGPROF timer fires every PROFILE_SAMPLE_INTERVAL_US of CPU time and
+charges the sample to whatever node the interpreter is on at that moment (or to the scheduler, if it's
+between resumes). At exit the per-node numbers are rolled up into source lines using the spans the parser
+records on every node.
+
+--profile-stacks <file> additionally writes the samples in collapsed stack format, one line per distinct
+AST path, which flamegraph.pl and speedscope both read.
+*/
+
+const int PROFILE_SAMPLE_INTERVAL_US = 1000;
+
+int profile_enabled = 0;
+char *profile_stacks_path = 0;
+
+ASTNode *profile_program;
+const char *profile_source;
+int profile_source_length;
+int *profile_line_starts;
+int profile_n_lines;
+
+// indexed by ASTNode id, sized before the program starts so the signal handler never has to grow them
+int profile_n_nodes;
+ASTNode **profile_nodes;
+long *profile_executions;
+long *profile_allocations;
+long *profile_allocation_bytes;
+volatile long *profile_samples;
+volatile long profile_scheduler_samples = 0;
+
+ASTNode *volatile profile_current_node = 0;
+
+void profile_on_sample(int signal)
+{
+    ASTNode *node = profile_current_node;
+    if (node) profile_samples[node->id] += 1;
+    else profile_scheduler_samples += 1;
+}
+
+void profile_count_execution(ASTNode *node)
+{
+    profile_executions[node->id] += 1;
+}
+
+void profile_count_allocation(int n_bytes)
+{
+    ASTNode *node = profile_current_node;
+    if (!node) return;
+    profile_allocations[node->id] += 1;
+    profile_allocation_bytes[node->id] += n_bytes;
+}
+
+void profile_register_nodes(ASTNode *node)
+{
+    while (node)
+    {
+        if (node->id >= profile_n_nodes) profile_n_nodes = node->id + 1;
+        profile_register_nodes(node->first_child);
+        node = node->next_sibling;
+    }
+}
+
+void profile_index_nodes(ASTNode *node)
+{
+    while (node)
+    {
+        profile_nodes[node->id] = node;
+        profile_index_nodes(node->first_child);
+        node = node->next_sibling;
+    }
+}
+
+void profile_begin(ASTNode *program, const char *source, int source_length)
+{
+    profile_program = program;
+    profile_source = source;
+    profile_source_length = source_length;
+
+    profile_n_nodes = 0;
+    profile_register_nodes(program);
+    profile_nodes = calloc(profile_n_nodes, sizeof(ASTNode*));
+    profile_executions = calloc(profile_n_nodes, sizeof(long));
+    profile_allocations = calloc(profile_n_nodes, sizeof(long));
+    profile_allocation_bytes = calloc(profile_n_nodes, sizeof(long));
+    profile_samples = calloc(profile_n_nodes, sizeof(long));
+    profile_index_nodes(program);
+
+    profile_n_lines = 1;
+    for (int i = 0; i < source_length; i++) profile_n_lines += source[i] == '\n';
+    profile_line_starts = malloc((profile_n_lines + 1) * sizeof(int));
+    profile_line_starts[0] = 0;
+    for (int i = 0, line = 1; i < source_length; i++)
+    {
+        if (source[i] == '\n') profile_line_starts[line++] = i + 1;
+    }
+    profile_line_starts[profile_n_lines] = source_length + 1;
+
+    // SA_RESTART, so that reads and writes interrupted by a sample are retried rather than failing
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_on_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, 0);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_SAMPLE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, 0);
+}
+
+// 1-based, like every editor
+int profile_line_of(int offset)
+{
+    int low = 0;
+    int high = profile_n_lines - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (profile_line_starts[middle] <= offset) low = middle;
+        else high = middle - 1;
+    }
+    return low + 1;
+}
+
+struct ProfileLine
+{
+    int line;
+    int start;
+    int end;
+    long samples;
+    long executions;
+    long allocations;
+    long allocation_bytes;
+};
+
+typedef struct ProfileLine ProfileLine;
+
+int profile_compare_lines(const void *a, const void *b)
+{
+    const ProfileLine *x = a;
+    const ProfileLine *y = b;
+    if (x->samples != y->samples) return x->samples < y->samples ? 1 : -1;
+    if (x->executions != y->executions) return x->executions < y->executions ? 1 : -1;
+    return x->line - y->line;
+}
+
+void profile_write_stack(FILE *file, ASTNode *node)
+{
+    if (node->parent)
+    {
+        profile_write_stack(file, node->parent);
+        fputc(';', file);
+    }
+    fprintf(file, "%s:%d", ast_node_type_name(node->type), profile_line_of(node->source_start));
+}
+
+void profile_write_stacks(char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open profile stacks file: %s\n", path);
+        return;
+    }
+
+    if (profile_scheduler_samples) fprintf(file, "(scheduler) %ld\n", profile_scheduler_samples);
+    for (int i = 0; i < profile_n_nodes; i++)
+    {
+        if (!profile_nodes[i] || !profile_samples[i]) continue;
+        profile_write_stack(file, profile_nodes[i]);
+        fprintf(file, " %ld\n", profile_samples[i]);
+    }
+
+    fclose(file);
+}
+
+void print_profile()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+
+    int n_lines = profile_n_lines;
+    ProfileLine *lines = calloc(n_lines + 1, sizeof(ProfileLine));
+    for (int i = 1; i <= n_lines; i++)
+    {
+        lines[i].line = i;
+        lines[i].start = profile_line_starts[i - 1];
+        lines[i].end = profile_line_starts[i] - 1;
+    }
+
+    long total_samples = profile_scheduler_samples;
+    long total_executions = 0;
+    for (int i = 0; i < profile_n_nodes; i++)
+    {
+        ASTNode *node = profile_nodes[i];
+        if (!node) continue;
+
+        total_samples += profile_samples[i];
+        total_executions += profile_executions[i];
+        if (node == profile_program) continue;
+
+        ProfileLine *line = &lines[profile_line_of(node->source_start)];
+        line->samples += profile_samples[i];
+        line->allocations += profile_allocations[i];
+        line->allocation_bytes += profile_allocation_bytes[i];
+
+        // a line runs as often as the outermost node on it, not as often as all its nodes put together
+        ASTNode *parent = node->parent;
+        if (!parent || parent == profile_program || profile_line_of(parent->source_start) != profile_line_of(node->source_start))
+        {
+            line->executions += profile_executions[i];
+        }
+    }
+
+    qsort(&lines[1], n_lines, sizeof(ProfileLine), profile_compare_lines);
+
+    FILE *file = stderr;
+    fprintf(file, "profile: %ld samples of %dus, %ld nodes executed, %ld samples in the scheduler\n",
+        total_samples, PROFILE_SAMPLE_INTERVAL_US, total_executions, profile_scheduler_samples);
+    fprintf(file, "%6s %10s %7s %12s %10s %12s  %s\n", "line", "time (ms)", "time", "executions", "allocs", "alloc bytes", "source");
+    for (int i = 1; i <= n_lines; i++)
+    {
+        ProfileLine *line = &lines[i];
+        if (!line->samples && !line->executions && !line->allocations) continue;
+
+        const char *text = &profile_source[line->start];
+        int length = line->end - line->start;
+        while (length > 0 && (*text == ' ' || *text == '\t'))
+        {
+            text += 1;
+            length -= 1;
+        }
+        if (length > 60) length = 60;
+
+        fprintf(file, "%6d %10.1f %6.1f%% %12ld %10ld %12ld  %.*s\n",
+            line->line, line->samples * PROFILE_SAMPLE_INTERVAL_US / 1000.0,
+            total_samples ? 100.0 * line->samples / total_samples : 0.0,
+            line->executions, line->allocations, line->allocation_bytes, length, text);
+    }
+
+    free(lines);
+
+    if (profile_stacks_path) profile_write_stacks(profile_stacks_path);
+}
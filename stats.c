@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+Runtime statistics for --stats. Counters are plain increments and are always kept, since they cost next
+to nothing. Anything that has to read the clock is only done when stats_enabled is set.
+*/
+
+int stats_enabled = 0;
+
+double stats_now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+struct AllocationStats
+{
+    long n_values;
+    long value_bytes;
+    long n_ast_nodes;
+    long ast_node_bytes;
+    long n_strings;
+    long string_bytes;
+};
+
+typedef struct AllocationStats AllocationStats;
+
+AllocationStats allocation_stats;
+
+enum BlockReason
+{
+    BLOCK_REASON_NONE,
+    BLOCK_REASON_PIPE_FULL,
+    BLOCK_REASON_PIPE_EMPTY,
+    BLOCK_REASON_HOST
+};
+
+struct ThreadStats
+{
+    long n_resumes;
+    long n_productive_resumes;
+    long n_blocked_resumes;
+    long n_preemptions;
+
+    double time_blocked_on_full_pipe;
+    double time_blocked_on_empty_pipe;
+    double time_blocked_on_host;
+
+    enum BlockReason blocked_reason;
+    double blocked_since;
+};
+
+typedef struct ThreadStats ThreadStats;
+
+// called at the end of every resume with whatever the thread ended up waiting on, if anything
+void stats_count_resume(ThreadStats *stats, int made_progress, enum BlockReason reason)
+{
+    stats->n_resumes += 1;
+    if (made_progress) stats->n_productive_resumes += 1;
+    else stats->n_blocked_resumes += 1;
+
+    if (!stats_enabled) return;
+
+    if (stats->blocked_reason != BLOCK_REASON_NONE && (made_progress || reason != stats->blocked_reason))
+    {
+        double blocked_for = stats_now() - stats->blocked_since;
+        if (stats->blocked_reason == BLOCK_REASON_PIPE_FULL) stats->time_blocked_on_full_pipe += blocked_for;
+        else if (stats->blocked_reason == BLOCK_REASON_PIPE_EMPTY) stats->time_blocked_on_empty_pipe += blocked_for;
+        else stats->time_blocked_on_host += blocked_for;
+        stats->blocked_reason = BLOCK_REASON_NONE;
+    }
+
+    if (reason != BLOCK_REASON_NONE && stats->blocked_reason == BLOCK_REASON_NONE)
+    {
+        stats->blocked_reason = reason;
+        stats->blocked_since = stats_now();
+    }
+}
+
+void stats_add_thread(ThreadStats *total, ThreadStats *stats)
+{
+    total->n_resumes += stats->n_resumes;
+    total->n_productive_resumes += stats->n_productive_resumes;
+    total->n_blocked_resumes += stats->n_blocked_resumes;
+    total->n_preemptions += stats->n_preemptions;
+    total->time_blocked_on_full_pipe += stats->time_blocked_on_full_pipe;
+    total->time_blocked_on_empty_pipe += stats->time_blocked_on_empty_pipe;
+    total->time_blocked_on_host += stats->time_blocked_on_host;
+}
+
+struct PipeStats
+{
+    long n_bytes_written;
+    int peak_occupancy;
+};
+
+typedef struct PipeStats PipeStats;
+
+void stats_add_pipe(PipeStats *total, PipeStats *stats)
+{
+    total->n_bytes_written += stats->n_bytes_written;
+    if (stats->peak_occupancy > total->peak_occupancy) total->peak_occupancy = stats->peak_occupancy;
+}
+
+/*
+Thread and pipe slots get handed out again once they're done with, which starts their counters over, so
+whatever the last user of a slot counted is added in here first.
+*/
+ThreadStats retired_thread_stats;
+long n_retired_threads = 0;
+PipeStats retired_pipe_stats;
+long n_retired_pipes = 0;
+
+void stats_retire_thread(ThreadStats *stats)
+{
+    stats_add_thread(&retired_thread_stats, stats);
+    n_retired_threads += 1;
+}
+
+void stats_retire_pipe(PipeStats *stats)
+{
+    stats_add_pipe(&retired_pipe_stats, stats);
+    n_retired_pipes += 1;
+}
+
+struct HostProcessStats
+{
+    char *program;
+    int pid;
+    double spawn_latency;
+    double started;
+    double wall_time;
+    struct rusage usage;
+    int exit_status;
+    int finished;
+};
+
+typedef struct HostProcessStats HostProcessStats;
+
+HostProcessStats host_process_stats[256];
+int n_host_process_stats = 0;
+int n_host_processes_spawned = 0;
+
+void print_allocation_stats(FILE *file)
+{
+    AllocationStats *stats = &allocation_stats;
+    fprintf(file, "allocations:\n");
+    fprintf(file, "  values:    %ld (%ld bytes)\n", stats->n_values, stats->value_bytes);
+    fprintf(file, "  AST nodes: %ld (%ld bytes)\n", stats->n_ast_nodes, stats->ast_node_bytes);
+    fprintf(file, "  strings:   %ld (%ld bytes)\n", stats->n_strings, stats->string_bytes);
+}
@@ -0,0 +1,6 @@
+n=0
+while [ $n -lt @COUNT@ ]
+do
+    n=$((n + 1))
+done
+echo $n
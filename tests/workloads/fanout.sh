@@ -0,0 +1,6 @@
+n=0
+while [ $n -lt @FANOUT@ ]
+do
+    /bin/true
+    n=$((n + 1))
+done
@@ -0,0 +1,4 @@
+while IFS= read -r line
+do
+    if [ "$line" = "apple pie" ]; then printf '%s\n' "$line"; fi
+done
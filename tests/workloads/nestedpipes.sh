@@ -0,0 +1,12 @@
+n=0
+{
+    {
+        while [ $n -lt @COUNT@ ]
+        do
+            echo "apple sauce"
+            echo "oranges"
+            echo "apple pie"
+            n=$((n + 1))
+        done
+    } | grep apple
+} | wc -l
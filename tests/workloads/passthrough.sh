@@ -0,0 +1 @@
+cat | wc -l
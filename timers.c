@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+/*
+Timers for sleep and timeout. Pending timers hang off a hashed timing wheel of TIMER_WHEEL_SLOTS slots, one per
+millisecond tick, so starting or cancelling one is a couple of pointer swaps however many there are, and
+expiring them only looks at the slots for the ticks that have actually gone by. A timer further away than one
+turn of the wheel just sits in its slot until the turn it's due.
+
+The scheduler never sleeps on the timers directly: there's a single timerfd, set for the earliest tick with
+anything due, and it's handed to hostio like any other fd, so waiting for a process and waiting for a timer
+are the same wait.
+*/
+
+enum { TIMER_WHEEL_SLOTS = 1024 };
+
+struct Timer
+{
+    long expiry; // in ticks since timers_initialise
+    int owner; // whatever the caller wants back when it goes off, eg. a thread
+    int kind;
+    int slot; // -1 = not pending, so the entry is free
+    int previous;
+    int next;
+};
+
+typedef struct Timer Timer;
+
+Timer *timers = 0;
+int timers_capacity = 0;
+int free_timer = -1; // chained through next
+int timer_wheel[TIMER_WHEEL_SLOTS]; // first timer in each slot, or -1
+int n_pending_timers = 0;
+
+long timer_now_tick = 0; // every tick before this one has been expired
+long timer_armed_tick = -1; // what the timerfd is set for, or -1 if it isn't
+int timer_fd = -1;
+int timers_changed = 0; // since the timerfd was last set
+
+long timers_n_started = 0;
+long timers_n_fired = 0;
+
+double timer_epoch;
+
+long timer_current_tick()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (long) ((time.tv_sec + time.tv_nsec * 1e-9 - timer_epoch) * 1000);
+}
+
+void timers_initialise()
+{
+    if (timer_fd != -1) return;
+
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    timer_epoch = time.tv_sec + time.tv_nsec * 1e-9;
+
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) timer_wheel[i] = -1;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        printf("ERROR: Could not create timer (%s:%d)\n", __FILE__, __LINE__);
+        exit(1);
+    }
+    hostio_adopt(timer_fd);
+}
+
+// goes off delay_ms from now, or as soon as timers_pop_expired is next asked if that has already passed
+int timer_start(int owner, int kind, long delay_ms)
+{
+    if (free_timer == -1)
+    {
+        int capacity = timers_capacity ? timers_capacity * 2 : 64;
+        timers = realloc(timers, capacity * sizeof(Timer));
+        for (int i = timers_capacity; i < capacity; i++)
+        {
+            timers[i].slot = -1;
+            timers[i].next = i + 1 < capacity ? i + 1 : -1;
+        }
+        free_timer = timers_capacity;
+        timers_capacity = capacity;
+    }
+
+    // with nothing pending there's nothing to miss, and no point walking all the ticks since the last one
+    if (n_pending_timers == 0) timer_now_tick = timer_current_tick();
+
+    int id = free_timer;
+    Timer *timer = &timers[id];
+    free_timer = timer->next;
+
+    if (delay_ms < 0) delay_ms = 0;
+    timer->expiry = timer_current_tick() + delay_ms;
+    if (timer->expiry < timer_now_tick) timer->expiry = timer_now_tick;
+    timer->owner = owner;
+    timer->kind = kind;
+    timer->slot = timer->expiry % TIMER_WHEEL_SLOTS;
+    timer->previous = -1;
+    timer->next = timer_wheel[timer->slot];
+    if (timer->next != -1) timers[timer->next].previous = id;
+    timer_wheel[timer->slot] = id;
+
+    n_pending_timers += 1;
+    timers_n_started += 1;
+    timers_changed = 1;
+    return id;
+}
+
+void timer_cancel(int id)
+{
+    Timer *timer = &timers[id];
+    if (timer->slot == -1) return;
+
+    if (timer->previous != -1) timers[timer->previous].next = timer->next;
+    else timer_wheel[timer->slot] = timer->next;
+    if (timer->next != -1) timers[timer->next].previous = timer->previous;
+
+    timer->slot = -1;
+    timer->next = free_timer;
+    free_timer = id;
+    n_pending_timers -= 1;
+    timers_changed = 1;
+}
+
+/*
+One timer that's due, or -1 once there are none. It's cancelled before it's handed back, so the id can be
+reused straight away. Ticks are only ever walked once, so a timer for later on in the same slot costs a look
+each turn of the wheel and nothing more.
+*/
+int timers_pop_expired(int *owner, int *kind)
+{
+    if (n_pending_timers == 0) return -1;
+
+    long now = timer_current_tick();
+    while (timer_now_tick <= now)
+    {
+        int slot = timer_now_tick % TIMER_WHEEL_SLOTS;
+        for (int id = timer_wheel[slot]; id != -1; id = timers[id].next)
+        {
+            if (timers[id].expiry > timer_now_tick) continue;
+
+            *owner = timers[id].owner;
+            *kind = timers[id].kind;
+            timer_cancel(id);
+            timers_n_fired += 1;
+            return id;
+        }
+
+        if (timer_now_tick == now) break;
+        timer_now_tick += 1;
+    }
+
+    return -1;
+}
+
+// the first tick from now on with something due in it, looking at most one turn of the wheel ahead
+long timers_next_expiry()
+{
+    for (long tick = timer_now_tick; tick < timer_now_tick + TIMER_WHEEL_SLOTS; tick++)
+    {
+        for (int id = timer_wheel[tick % TIMER_WHEEL_SLOTS]; id != -1; id = timers[id].next)
+        {
+            if (timers[id].expiry <= tick) return tick;
+        }
+    }
+
+    return timer_now_tick + TIMER_WHEEL_SLOTS;
+}
+
+// sets the timerfd for the next timer due, and has hostio wait on it - called after every round of expiring,
+// but only does anything if a timer has come or gone, or the timerfd has gone off
+void timers_arm()
+{
+    if (!timers_changed && (timer_armed_tick == -1 || !hostio_is_ready(timer_fd))) return;
+    timers_changed = 0;
+
+    if (n_pending_timers == 0)
+    {
+        // all cancelled, so there's nothing for an idle scheduler to wake up for
+        if (timer_armed_tick != -1)
+        {
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            timerfd_settime(timer_fd, 0, &spec, 0);
+            hostio_forget(timer_fd);
+            timer_armed_tick = -1;
+        }
+        return;
+    }
+
+    // it has gone off, so it has to be emptied before anything polls it again
+    if (hostio_is_ready(timer_fd))
+    {
+        unsigned long long n_expirations;
+        if (read(timer_fd, &n_expirations, sizeof(n_expirations)) == -1) {}
+        timer_armed_tick = -1;
+    }
+
+    long tick = timers_next_expiry();
+    if (tick != timer_armed_tick)
+    {
+        // absolute, so that nothing is lost to the time it took to get here
+        double at = timer_epoch + tick / 1000.0;
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = (time_t) at;
+        spec.it_value.tv_nsec = (long) ((at - (time_t) at) * 1e9);
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, 0);
+        timer_armed_tick = tick;
+    }
+
+    hostio_would_block(timer_fd, POLLIN);
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+
+/*
+Scheduler trace for --trace, written in Chrome's trace event format so it can be opened in Perfetto or
+chrome://tracing. Interpreter threads show up as tracks of the "cha" process, with one slice per
+resume_execution named after the node it resumed at. Host processes get their own tracks under "host",
+one slice per process lifetime.
+
+Events are written as they happen, so nothing is kept in memory - but every resume costs two clock reads
+and an fprintf, so expect a traced run to be a good deal slower than an untraced one.
+*/
+
+const int TRACE_PID_THREADS = 1;
+const int TRACE_PID_HOST = 2;
+
+FILE *trace_file = 0;
+double trace_started;
+int n_trace_events = 0;
+
+double trace_timestamp(double time)
+{
+    return (time - trace_started) * 1e6;
+}
+
+void trace_write_string(const char *string)
+{
+    fputc('"', trace_file);
+    for (const char *c = string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') fprintf(trace_file, "\\%c", *c);
+        else if ((unsigned char) *c < 0x20) fprintf(trace_file, "\\u%04x", *c);
+        else fputc(*c, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+// starts an event and leaves its object open, so the caller can add fields before trace_end_event
+void trace_begin_event(const char *name, const char *phase, int pid, int tid, double time)
+{
+    fprintf(trace_file, "%s\n{\"name\":", n_trace_events == 0 ? "" : ",");
+    trace_write_string(name);
+    fprintf(trace_file, ",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", phase, pid, tid, trace_timestamp(time));
+    n_trace_events += 1;
+}
+
+void trace_end_event()
+{
+    fputc('}', trace_file);
+}
+
+void trace_metadata(const char *kind, int pid, int tid, const char *name)
+{
+    trace_begin_event(kind, "M", pid, tid, trace_started);
+    fprintf(trace_file, ",\"args\":{\"name\":");
+    trace_write_string(name);
+    fprintf(trace_file, "}");
+    trace_end_event();
+}
+
+int trace_open(char *path)
+{
+    trace_file = fopen(path, "w");
+    if (!trace_file) return 0;
+
+    trace_started = stats_now();
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    trace_metadata("process_name", TRACE_PID_THREADS, 0, "cha");
+    trace_metadata("process_name", TRACE_PID_HOST, 0, "host");
+
+    return 1;
+}
+
+void trace_close()
+{
+    if (!trace_file) return;
+
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = 0;
+}
+
+const char *trace_block_reason_name(enum BlockReason reason)
+{
+    switch (reason)
+    {
+        case BLOCK_REASON_PIPE_FULL: return "pipe full";
+        case BLOCK_REASON_PIPE_EMPTY: return "pipe empty";
+        case BLOCK_REASON_HOST: return "host";
+        default: return "none";
+    }
+}
+
+void trace_thread_spawned(int thread_id, int parent_id, enum ASTNodeType root_type)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "#%d %s", thread_id, ast_node_type_name(root_type));
+    trace_metadata("thread_name", TRACE_PID_THREADS, thread_id, name);
+
+    trace_begin_event("spawn", "i", TRACE_PID_THREADS, parent_id == -1 ? thread_id : parent_id, stats_now());
+    fprintf(trace_file, ",\"s\":\"t\",\"args\":{\"thread\":%d,\"root\":\"%s\"}", thread_id, ast_node_type_name(root_type));
+    trace_end_event();
+}
+
+void trace_thread_finished(int thread_id)
+{
+    trace_begin_event("finish", "i", TRACE_PID_THREADS, thread_id, stats_now());
+    fprintf(trace_file, ",\"s\":\"t\"");
+    trace_end_event();
+}
+
+// one slice per resume_execution, plus an instant event when it ended by yielding. Pipe ids are -1 for
+// stdin/stdout
+void trace_resume(int thread_id, double started, enum ASTNodeType node_type, int n_executed, enum BlockReason reason, int read_pipe_id, int write_pipe_id)
+{
+    double finished = stats_now();
+    trace_begin_event(ast_node_type_name(node_type), "X", TRACE_PID_THREADS, thread_id, started);
+    fprintf(trace_file, ",\"dur\":%.3f,\"args\":{\"nodes\":%d,\"yield\":\"%s\",\"read_pipe\":%d,\"write_pipe\":%d}",
+        trace_timestamp(finished) - trace_timestamp(started), n_executed, trace_block_reason_name(reason), read_pipe_id, write_pipe_id);
+    trace_end_event();
+
+    if (reason != BLOCK_REASON_NONE)
+    {
+        int pipe_id = reason == BLOCK_REASON_PIPE_FULL ? write_pipe_id : read_pipe_id;
+        trace_begin_event("yield", "i", TRACE_PID_THREADS, thread_id, finished);
+        fprintf(trace_file, ",\"s\":\"t\",\"args\":{\"reason\":\"%s\",\"pipe\":%d}", trace_block_reason_name(reason), pipe_id);
+        trace_end_event();
+    }
+}
+
+void trace_host_launched(int thread_id, char *program, int pid)
+{
+    trace_begin_event("launch", "i", TRACE_PID_THREADS, thread_id, stats_now());
+    fprintf(trace_file, ",\"s\":\"t\",\"args\":{\"pid\":%d,\"program\":", pid);
+    trace_write_string(program);
+    fprintf(trace_file, "}");
+    trace_end_event();
+
+    trace_metadata("thread_name", TRACE_PID_HOST, pid, program);
+}
+
+void trace_host_exited(int thread_id, char *program, int pid, double started, int exit_status)
+{
+    double finished = stats_now();
+    trace_begin_event(program, "X", TRACE_PID_HOST, pid, started);
+    fprintf(trace_file, ",\"dur\":%.3f,\"args\":{\"thread\":%d,\"exit\":%d}",
+        trace_timestamp(finished) - trace_timestamp(started), thread_id, exit_status);
+    trace_end_event();
+
+    trace_begin_event("exit", "i", TRACE_PID_THREADS, thread_id, finished);
+    fprintf(trace_file, ",\"s\":\"t\",\"args\":{\"pid\":%d,\"exit\":%d}", pid, exit_status);
+    trace_end_event();
+}